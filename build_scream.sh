@@ -139,7 +139,7 @@ echo "Kernel version: $(uname -r)"
 
 # Check for required files
 echo "Checking required files..."
-required_files=("Makefile" "snd-screamalsa.c")
+required_files=("Makefile" "snd-screamalsa.c" "scream_trace.h" "scream_proto.h" "scream_fec.h")
 for file in "${required_files[@]}"; do
     if [[ -f "$file" ]]; then
         echo "✓ $file found"
@@ -0,0 +1,173 @@
+/*
+ * ScreamALSA forward error correction
+ *
+ * Shared by the driver and userspace receivers. Data packets are plain
+ * Scream packets, unchanged. After every group of N data packets the
+ * sender emits K parity datagrams to a parity port: the stream port + 1
+ * by default, or the card's fec_ports setting. No receiver may play audio
+ * on that port, because a legacy receiver would play the parity as noise.
+ * With several cards on consecutive ports, port + 1 is the next card's
+ * port, so the driver disables FEC on a card whose parity port is an audio
+ * port of any card, fanout included, and fec_ports must be set.
+ *
+ * Parity j is the XOR of the payloads of the group members i with
+ * i % K == j, so any single loss among those members can be rebuilt, and
+ * K interleaved parities cover a burst of K losses.
+ *
+ * Parity datagram, little-endian:
+ *
+ *   0  "SCFC"
+ *   4  version (1)
+ *   5  N, group size
+ *   6  K, parities per group
+ *   7  j, this parity's index
+ *   8  group sequence number (u32)
+ *  12  payload length of every member (u16)
+ *  14  reserved (u16)
+ *  16  N x u32 hash of each member packet, header included
+ *  16 + 4N  XOR of the covered payloads
+ *
+ * The member hashes let a receiver tell which of the packets it holds
+ * belong to the group, and which one is missing, without any sequence
+ * numbers in the data stream. Without them, identical packets (digital
+ * silence, a repeated buffer) hash alike and cannot be told apart: a
+ * receiver must skip a group with duplicate member hashes, and a loss may
+ * go unnoticed when an identical packet is still held. With the extended
+ * header (scream_proto.h) the hashed header carries the sequence number,
+ * so every member hash is distinct; use ext_header=1 together with FEC.
+ *
+ * License: GPL-2
+ */
+
+#ifndef _SCREAM_FEC_H
+#define _SCREAM_FEC_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#endif
+
+#define SCREAM_FEC_MAGIC        "SCFC"
+#define SCREAM_FEC_VERSION      1
+#define SCREAM_FEC_HDR_SIZE     16
+#define SCREAM_FEC_MAX_GROUP    16
+#define SCREAM_FEC_MAX_PARITY   4
+#define SCREAM_FEC_HASH_INIT    2166136261u
+
+struct scream_fec_info {
+    unsigned int group;             /* N */
+    unsigned int parities;          /* K */
+    unsigned int index;             /* j */
+    uint32_t seq;
+    unsigned int payload_len;
+    const uint8_t *hashes;          /* N little-endian u32 */
+    const uint8_t *parity;          /* payload_len bytes */
+};
+
+static inline void scream_fec_put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void scream_fec_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint32_t scream_fec_get32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* FNV-1a; feed a packet in pieces starting from SCREAM_FEC_HASH_INIT */
+static inline uint32_t scream_fec_hash(uint32_t h, const uint8_t *p, size_t len)
+{
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline void scream_fec_xor(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    while (len--)
+        *dst++ ^= *src++;
+}
+
+/* Fill the 16-byte parity header */
+static inline void scream_fec_put_header(uint8_t *p, unsigned int group, unsigned int parities,
+                                         unsigned int index, uint32_t seq, unsigned int payload_len)
+{
+    memcpy(p, SCREAM_FEC_MAGIC, 4);
+    p[4] = SCREAM_FEC_VERSION;
+    p[5] = group;
+    p[6] = parities;
+    p[7] = index;
+    scream_fec_put32(p + 8, seq);
+    scream_fec_put16(p + 12, payload_len);
+    scream_fec_put16(p + 14, 0);
+}
+
+/* 0 if pkt is a well-formed parity datagram */
+static inline int scream_fec_parse(const uint8_t *pkt, size_t len, struct scream_fec_info *fi)
+{
+    if (len < SCREAM_FEC_HDR_SIZE || memcmp(pkt, SCREAM_FEC_MAGIC, 4) || pkt[4] != SCREAM_FEC_VERSION)
+        return -1;
+    fi->group = pkt[5];
+    fi->parities = pkt[6];
+    fi->index = pkt[7];
+    fi->seq = scream_fec_get32(pkt + 8);
+    fi->payload_len = pkt[12] | pkt[13] << 8;
+    if (!fi->group || fi->group > SCREAM_FEC_MAX_GROUP || !fi->parities ||
+        fi->parities > fi->group || fi->index >= fi->parities ||
+        len != SCREAM_FEC_HDR_SIZE + 4 * fi->group + fi->payload_len)
+        return -1;
+    fi->hashes = pkt + SCREAM_FEC_HDR_SIZE;
+    fi->parity = fi->hashes + 4 * fi->group;
+    return 0;
+}
+
+static inline uint32_t scream_fec_member_hash(const struct scream_fec_info *fi, unsigned int i)
+{
+    return scream_fec_get32(fi->hashes + 4 * i);
+}
+
+/*
+ * Rebuild the one missing payload covered by parity fi. payloads[i] is
+ * member i's payload or NULL if it was lost; members this parity does not
+ * cover are ignored. Returns the rebuilt member's index, or -1 if nothing
+ * or more than one covered member is missing.
+ */
+static inline int scream_fec_recover(const struct scream_fec_info *fi,
+                                     const uint8_t *const payloads[], uint8_t *out)
+{
+    unsigned int i;
+    int missing = -1;
+
+    for (i = fi->index; i < fi->group; i += fi->parities) {
+        if (payloads[i])
+            continue;
+        if (missing >= 0)
+            return -1;
+        missing = i;
+    }
+    if (missing < 0)
+        return -1;
+
+    memcpy(out, fi->parity, fi->payload_len);
+    for (i = fi->index; i < fi->group; i += fi->parities)
+        if (payloads[i])
+            scream_fec_xor(out, payloads[i], fi->payload_len);
+    return missing;
+}
+
+#endif /* _SCREAM_FEC_H */
@@ -0,0 +1,131 @@
+/*
+ * ScreamALSA wire format additions
+ *
+ * Shared by the driver and userspace receivers. A Scream packet starts
+ * with the 5-byte header:
+ *
+ *   0  rate: bit 7 set = 44100 * (b & 0x7f), else 48000 * b
+ *   1  bits per sample, 1 for DSD
+ *   2  channels
+ *   3  channel mask
+ *   4  flags, 0 on legacy streams
+ *
+ * Flags are only ever set toward receivers that asked for them, so legacy
+ * receivers keep seeing 0 (or the end-of-track marker).
+ *
+ * Extended header (SCREAM_FLAG_EXT): 21 more bytes follow the base
+ * header, little-endian, before the payload:
+ *
+ *   5  extension version (1)
+ *   6  sequence number (u32), one per data packet, runs across streams
+ *  10  index of the first frame in this packet since the stream started (u64)
+ *  18  CLOCK_MONOTONIC send time in ns (u64)
+ *
+ * A receiver asks for it by sending an 8-byte record back over the
+ * feedback channel: "SCXH" and a u32 capability mask, bit 0 = extended
+ * header. The header is switched on for the whole stream, so the sender
+ * honours this only from the stream's sole receiver: a TCP peer, or a UDP
+ * stream with one unicast destination and the record coming from its
+ * address. With fanout or multicast, legacy receivers keep plain packets.
+ *
+ * Silence marker (SCREAM_FLAG_SILENCE, UDP only): the payload is replaced
+ * by a u32 frame count, little-endian, right after the header. The
+ * receiver plays that many frames of silence in the format the header
+ * names: zero samples for PCM, the 0x69 idle pattern for DSD. One marker
+ * may stand for several packets.
+ *
+ * Compressed payload (SCREAM_FLAG_LZ4, UDP only): a u16 little-endian
+ * uncompressed length, then one raw LZ4 block (no frame header). Each
+ * datagram decompresses on its own. Packets that do not shrink are sent
+ * uncompressed, so the flag can change from one packet to the next.
+ *
+ * License: GPL-2
+ */
+
+#ifndef _SCREAM_PROTO_H
+#define _SCREAM_PROTO_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+#define SCREAM_FLAG_END         0x80    /* end of track, header only */
+#define SCREAM_FLAG_EXT         0x40    /* extended header follows */
+#define SCREAM_FLAG_SILENCE     0x20    /* frame count instead of payload */
+#define SCREAM_FLAG_LZ4         0x10    /* LZ4-compressed payload */
+
+#define SCREAM_BASE_HEADER_SIZE 5
+#define SCREAM_EXT_VERSION      1
+#define SCREAM_EXT_HEADER_SIZE  26
+#define SCREAM_SILENCE_SIZE     4
+#define SCREAM_LZ4_LEN_SIZE     2
+#define SCREAM_DSD_IDLE         0x69
+
+#define SCREAM_XH_MAGIC         "SCXH"
+#define SCREAM_XH_SIZE          8
+#define SCREAM_CAP_EXT_HEADER   0x1
+
+struct scream_ext_header {
+    uint32_t seq;
+    uint64_t frame;
+    uint64_t time_ns;
+};
+
+static inline void scream_proto_put64(uint8_t *p, uint64_t v)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        p[i] = v >> (8 * i);
+}
+
+static inline uint64_t scream_proto_get64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        v = v << 8 | p[i];
+    return v;
+}
+
+/* Fill bytes 5..25 of a packet whose flags byte has SCREAM_FLAG_EXT */
+static inline void scream_ext_put(uint8_t *hdr, uint32_t seq, uint64_t frame, uint64_t time_ns)
+{
+    hdr[5] = SCREAM_EXT_VERSION;
+    hdr[6] = seq;
+    hdr[7] = seq >> 8;
+    hdr[8] = seq >> 16;
+    hdr[9] = seq >> 24;
+    scream_proto_put64(hdr + 10, frame);
+    scream_proto_put64(hdr + 18, time_ns);
+}
+
+/* 0 and *xh filled if hdr carries a known extended header */
+static inline int scream_ext_get(const uint8_t *hdr, size_t len, struct scream_ext_header *xh)
+{
+    if (len < SCREAM_EXT_HEADER_SIZE || !(hdr[4] & SCREAM_FLAG_EXT) || hdr[5] != SCREAM_EXT_VERSION)
+        return -1;
+    xh->seq = hdr[6] | hdr[7] << 8 | hdr[8] << 16 | (uint32_t)hdr[9] << 24;
+    xh->frame = scream_proto_get64(hdr + 10);
+    xh->time_ns = scream_proto_get64(hdr + 18);
+    return 0;
+}
+
+static inline void scream_silence_put(uint8_t *p, uint32_t frames)
+{
+    p[0] = frames;
+    p[1] = frames >> 8;
+    p[2] = frames >> 16;
+    p[3] = frames >> 24;
+}
+
+static inline uint32_t scream_silence_get(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+#endif /* _SCREAM_PROTO_H */
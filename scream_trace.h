@@ -0,0 +1,141 @@
+/*
+ * ScreamALSA trace events
+ *
+ * perf list 'screamalsa:*'  or  /sys/kernel/tracing/events/screamalsa/
+ *
+ * License: GPL-2
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM screamalsa
+
+#if !defined(_SCREAM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCREAM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Payloads taken from the ring for one batch */
+TRACE_EVENT(scream_build,
+    TP_PROTO(int card, unsigned int npkts, size_t hw_ptr, bool zerocopy),
+    TP_ARGS(card, npkts, hw_ptr, zerocopy),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(unsigned int, npkts)
+        __field(size_t, hw_ptr)
+        __field(bool, zerocopy)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->npkts = npkts;
+        __entry->hw_ptr = hw_ptr;
+        __entry->zerocopy = zerocopy;
+    ),
+    TP_printk("card=%d npkts=%u hw_ptr=%zu zerocopy=%d",
+              __entry->card, __entry->npkts, __entry->hw_ptr, __entry->zerocopy)
+);
+
+/* One kernel_sendmsg call; dest is the receiver index, -1 for TCP */
+TRACE_EVENT(scream_send,
+    TP_PROTO(int card, int dest, int ret, size_t len, s64 duration_ns),
+    TP_ARGS(card, dest, ret, len, duration_ns),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(int, dest)
+        __field(int, ret)
+        __field(size_t, len)
+        __field(s64, duration_ns)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->dest = dest;
+        __entry->ret = ret;
+        __entry->len = len;
+        __entry->duration_ns = duration_ns;
+    ),
+    TP_printk("card=%d dest=%d ret=%d len=%zu duration_ns=%lld",
+              __entry->card, __entry->dest, __entry->ret, __entry->len,
+              (long long)__entry->duration_ns)
+);
+
+/* Engine woke for a stream: the deadline it was due at and the actual time */
+TRACE_EVENT(scream_pacing,
+    TP_PROTO(int card, s64 target_ns, s64 wake_ns, unsigned int npkts),
+    TP_ARGS(card, target_ns, wake_ns, npkts),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(s64, target_ns)
+        __field(s64, wake_ns)
+        __field(unsigned int, npkts)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->target_ns = target_ns;
+        __entry->wake_ns = wake_ns;
+        __entry->npkts = npkts;
+    ),
+    TP_printk("card=%d target=%lld wake=%lld late_ns=%lld npkts=%u",
+              __entry->card, (long long)__entry->target_ns, (long long)__entry->wake_ns,
+              (long long)(__entry->wake_ns - __entry->target_ns), __entry->npkts)
+);
+
+TRACE_EVENT(scream_period_elapsed,
+    TP_PROTO(int card, size_t hw_ptr),
+    TP_ARGS(card, hw_ptr),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(size_t, hw_ptr)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->hw_ptr = hw_ptr;
+    ),
+    TP_printk("card=%d hw_ptr=%zu", __entry->card, __entry->hw_ptr)
+);
+
+TRACE_EVENT(scream_trigger,
+    TP_PROTO(int card, int cmd),
+    TP_ARGS(card, cmd),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(int, cmd)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->cmd = cmd;
+    ),
+    TP_printk("card=%d cmd=%s", __entry->card,
+              __entry->cmd == SNDRV_PCM_TRIGGER_START ? "start" :
+              __entry->cmd == SNDRV_PCM_TRIGGER_STOP ? "stop" : "other")
+);
+
+/* TCP connection state machine; states are STATE_DISCONNECTED/CONNECTING/CONNECTED */
+TRACE_EVENT(scream_conn_state,
+    TP_PROTO(int card, int old_state, int new_state, int attempts, int err),
+    TP_ARGS(card, old_state, new_state, attempts, err),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(int, old_state)
+        __field(int, new_state)
+        __field(int, attempts)
+        __field(int, err)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->old_state = old_state;
+        __entry->new_state = new_state;
+        __entry->attempts = attempts;
+        __entry->err = err;
+    ),
+    TP_printk("card=%d %d->%d attempts=%d err=%d",
+              __entry->card, __entry->old_state, __entry->new_state,
+              __entry->attempts, __entry->err)
+);
+
+#endif /* _SCREAM_TRACE_H */
+
+/* Built out of tree: the Makefile adds the source directory to the include path */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scream_trace
+#include <trace/define_trace.h>
@@ -42,11 +42,14 @@
 #include <linux/vmalloc.h>
 #include <linux/compiler.h>
 #include <linux/platform_device.h>
+#include <linux/netdevice.h>
 #include <sound/core.h>
 #include <sound/pcm.h>
 #include <sound/pcm_params.h>
 #include <sound/initval.h>
 #include <sound/memalloc.h>
+#include <sound/info.h>
+#include <sound/control.h>
 #include <linux/jiffies.h>
 #include <linux/fcntl.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
@@ -58,11 +61,52 @@
 #error "This driver requires Linux kernel 3.8 or later"
 #endif
 
+/* UDP_SEGMENT: let the stack cut one send into equal-sized datagrams */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+    #include <linux/udp.h>
+    #define SCREAM_HAVE_UDP_GSO 1
+#endif
+
+/* LZ4 payload compression, when the kernel has lib/lz4 */
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS)
+    #include <linux/lz4.h>
+    #define SCREAM_HAVE_LZ4 1
+#endif
+
 /* For KERNEL_SOCKPTR macro on newer kernels */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
     #include <linux/sockptr.h>
 #endif
 
+/* SIMD DSD byte shuffle */
+#if defined(CONFIG_X86_64) && LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+    #define SCREAM_SIMD_X86 1
+    #include <asm/cpufeature.h>
+    #include <asm/fpu/api.h>
+    #include <asm/simd.h>
+    #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0) || defined(CONFIG_AS_AVX2)
+        #define SCREAM_SIMD_AVX2 1
+    #endif
+#elif defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON) && \
+      LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+    #define SCREAM_SIMD_NEON 1
+    #include <asm/neon.h>
+    #include <asm/simd.h>
+#endif
+
+#include "scream_proto.h"
+#include "scream_fec.h"
+
+#define CREATE_TRACE_POINTS
+#include "scream_trace.h"
+
+/* Skip the clock reads feeding a trace event when nobody listens */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
+#define scream_trace_on(event) trace_##event##_enabled()
+#else
+#define scream_trace_on(event) true
+#endif
+
 MODULE_AUTHOR("I.Antonov igor63r@gmail.com");
 MODULE_VERSION("2.0.0");
 
@@ -90,13 +134,200 @@ static int port = 4011;
 module_param(port, int, 0644);
 MODULE_PARM_DESC(port, "Target port");
 
+static int tx_batch = 1;
+module_param(tx_batch, int, 0644);
+MODULE_PARM_DESC(tx_batch, "Max packets sent per tx wakeup (1-16, 1 = one packet per wakeup)");
+
+static int tx_batch_us = 0;
+module_param(tx_batch_us, int, 0644);
+MODULE_PARM_DESC(tx_batch_us, "Latency budget for a batch in microseconds (0 = limited by tx_batch only)");
+
+static char payload_policy[16] = "fixed"; // "fixed" or "adaptive"
+module_param_string(payload_policy, payload_policy, sizeof(payload_policy), 0644);
+MODULE_PARM_DESC(payload_policy, "Payload sizing: 'fixed' (1152 bytes, legacy receivers) or 'adaptive'");
+
+static int mtu = 1500;
+module_param(mtu, int, 0644);
+MODULE_PARM_DESC(mtu, "Link MTU used by the adaptive payload policy (576-9000)");
+
+static int max_pps = 0;
+module_param(max_pps, int, 0644);
+MODULE_PARM_DESC(max_pps, "Adaptive policy: max packets per second (0 = fill the MTU)");
+
+static bool wire_native = false;
+module_param(wire_native, bool, 0644);
+MODULE_PARM_DESC(wire_native, "Send S16_LE/S24_3LE at their own width instead of widening to 32-bit");
+
+static bool dsd_simd = true;
+module_param(dsd_simd, bool, 0444);
+MODULE_PARM_DESC(dsd_simd, "Use SSSE3/AVX2/NEON for the DSD byte shuffle when the CPU supports it");
+
+static bool zerocopy = true;
+module_param(zerocopy, bool, 0644);
+MODULE_PARM_DESC(zerocopy, "Send PCM payloads straight from the ALSA ring without an intermediate copy");
+
+static bool udp_gso = false;
+module_param(udp_gso, bool, 0644);
+MODULE_PARM_DESC(udp_gso, "Hand each UDP batch to the stack as one segmentation-offload send (kernel 4.18+, needs tx_batch > 1)");
+
+static int tcp_cork_us = 0;
+module_param(tcp_cork_us, int, 0644);
+MODULE_PARM_DESC(tcp_cork_us, "Let TCP hold back batches for up to this long to fill segments (0 = push every batch)");
+
+static bool tcp_zerocopy = false;
+module_param(tcp_zerocopy, bool, 0644);
+MODULE_PARM_DESC(tcp_zerocopy, "Send TCP batches as page references from a small buffer pool instead of copying them into the socket");
+
+static int tcp_backlog_ms = 100;
+module_param(tcp_backlog_ms, int, 0644);
+MODULE_PARM_DESC(tcp_backlog_ms, "Audio kept for retry while the TCP socket is full, in ms (0 = drop it at once)");
+
+static char tcp_backlog_policy[8] = "drop";
+module_param_string(tcp_backlog_policy, tcp_backlog_policy, sizeof(tcp_backlog_policy), 0644);
+MODULE_PARM_DESC(tcp_backlog_policy, "When the TCP backlog is full: 'drop' the oldest packets or 'stall' the ALSA pointer");
+
+#define SCREAM_MAX_CARDS 8
+#define SCREAM_MAX_TX_THREADS 4
+
+static int cards = 1;
+module_param(cards, int, 0444);
+MODULE_PARM_DESC(cards, "Number of virtual cards to create (1-8)");
+
+static char *ip_addrs[SCREAM_MAX_CARDS];
+module_param_array(ip_addrs, charp, NULL, 0444);
+MODULE_PARM_DESC(ip_addrs, "Per-card target IP address (default: ip_addr_str)");
+
+static int ports[SCREAM_MAX_CARDS];
+module_param_array(ports, int, NULL, 0444);
+MODULE_PARM_DESC(ports, "Per-card target port (default: port + card number)");
+
+static char *protocols[SCREAM_MAX_CARDS];
+module_param_array(protocols, charp, NULL, 0444);
+MODULE_PARM_DESC(protocols, "Per-card protocol 'udp' or 'tcp' (default: protocol_str)");
+
+static int tx_threads = 1;
+module_param(tx_threads, int, 0444);
+MODULE_PARM_DESC(tx_threads, "RT threads shared by all cards for sending (1-4)");
+
+static char tx_sched[16] = "fifo"; // "fifo" or "deadline"
+module_param_string(tx_sched, tx_sched, sizeof(tx_sched), 0444);
+MODULE_PARM_DESC(tx_sched, "Tx thread scheduling: 'fifo' or 'deadline' (a bandwidth reservation sized from the packet interval of the streams it serves)");
+
+static int tx_prio = 50;
+module_param(tx_prio, int, 0444);
+MODULE_PARM_DESC(tx_prio, "SCHED_FIFO priority of the tx threads (1-99), also used before a deadline reservation is in place");
+
+static int tx_dl_pct = 10;
+module_param(tx_dl_pct, int, 0644);
+MODULE_PARM_DESC(tx_dl_pct, "SCHED_DEADLINE runtime per stream, in percent of its wakeup interval (1-90); applied when the set of streams changes");
+
+static char tx_cpus[64];
+module_param_string(tx_cpus, tx_cpus, sizeof(tx_cpus), 0444);
+MODULE_PARM_DESC(tx_cpus, "CPUs the tx threads may run on, as a list like '2-3' (default: any)");
+
+static char *fanout[SCREAM_MAX_CARDS];
+module_param_array(fanout, charp, NULL, 0444);
+MODULE_PARM_DESC(fanout, "Per-card extra UDP receivers 'ip[:port];ip[:port]' (port defaults to the card port)");
+
+static char *standby[SCREAM_MAX_CARDS];
+module_param_array(standby, charp, NULL, 0444);
+MODULE_PARM_DESC(standby, "Per-card TCP standby receivers 'ip[:port];ip[:port]', kept connected and switched to when the active one fails (port defaults to the card port)");
+
+static int tcp_health_ms = 500;
+module_param(tcp_health_ms, int, 0644);
+MODULE_PARM_DESC(tcp_health_ms, "How often standby TCP connections are checked and re-established, in ms (50-10000)");
+
+static int fec_group[SCREAM_MAX_CARDS];
+module_param_array(fec_group, int, NULL, 0444);
+MODULE_PARM_DESC(fec_group, "Per-card UDP FEC group size N: parity datagrams follow every N packets (0 = off, max 16); best with ext_header, see scream_fec.h");
+
+static int fec_ports[SCREAM_MAX_CARDS];
+module_param_array(fec_ports, int, NULL, 0444);
+MODULE_PARM_DESC(fec_ports, "Per-card port for FEC parity at every receiver (default: each receiver's port + 1); must not be a port any card streams to");
+
+static int fec_parity[SCREAM_MAX_CARDS];
+module_param_array(fec_parity, int, NULL, 0444);
+MODULE_PARM_DESC(fec_parity, "Per-card parity datagrams per FEC group K, for an overhead of K/N (default 1, max 4)");
+
+static int mcast_ttl = 1;
+module_param(mcast_ttl, int, 0644);
+MODULE_PARM_DESC(mcast_ttl, "TTL for multicast destinations (0-255)");
+
+static char mcast_if[IFNAMSIZ] = "";
+module_param_string(mcast_if, mcast_if, sizeof(mcast_if), 0644);
+MODULE_PARM_DESC(mcast_if, "Outgoing interface for multicast destinations (default: by route)");
+
+static int pacing_spin_us = 0;
+module_param(pacing_spin_us, int, 0644);
+MODULE_PARM_DESC(pacing_spin_us, "Busy-wait the last N microseconds before a packet is due (0 = sleep only, max 1000)");
+
+static bool feedback = false;
+module_param(feedback, bool, 0644);
+MODULE_PARM_DESC(feedback, "Trim the pacing rate from receiver buffer-fill reports");
+
+static int fb_target_us = 20000;
+module_param(fb_target_us, int, 0644);
+MODULE_PARM_DESC(fb_target_us, "Receiver buffer fill to hold, in microseconds");
+
+static int fb_max_ppm = 300;
+module_param(fb_max_ppm, int, 0644);
+MODULE_PARM_DESC(fb_max_ppm, "Largest pacing correction applied by feedback, in ppm (max 10000)");
+
+static int ext_header = 0;
+module_param(ext_header, int, 0644);
+MODULE_PARM_DESC(ext_header, "Extended header with sequence number and send time: 0 = off, 1 = always, 2 = when the stream's only receiver asks over the feedback channel");
+
+static bool silence_suppress = false;
+module_param(silence_suppress, bool, 0644);
+MODULE_PARM_DESC(silence_suppress, "UDP: send runs of silent packets as one short marker (receivers must know SCREAM_FLAG_SILENCE)");
+
+static bool lz4 = false;
+module_param(lz4, bool, 0644);
+MODULE_PARM_DESC(lz4, "UDP: LZ4-compress payloads that shrink enough (receivers must know SCREAM_FLAG_LZ4); buffers are set up when a stream opens");
+
+static int lz4_min_saving = 10;
+module_param(lz4_min_saving, int, 0644);
+MODULE_PARM_DESC(lz4_min_saving, "Percent a payload must shrink by to go out compressed; poorer results back off for a while");
+
+static int capture_port = 0;
+module_param(capture_port, int, 0444);
+MODULE_PARM_DESC(capture_port, "Receive Scream streams on this port (+ card number) into a capture PCM (0 = no capture)");
+
+static char capture_protocol[8] = "udp";
+module_param_string(capture_protocol, capture_protocol, sizeof(capture_protocol), 0644);
+MODULE_PARM_DESC(capture_protocol, "Capture transport: 'udp' or 'tcp'");
+
+static int capture_jitter_ms = 20;
+module_param(capture_jitter_ms, int, 0644);
+MODULE_PARM_DESC(capture_jitter_ms, "Audio buffered before capture data is handed to the application, in ms");
+
+static int selftest = 0;
+module_param(selftest, int, 0444);
+MODULE_PARM_DESC(selftest, "At load: 1 = check the packetization helpers (a failure fails the load), 2 = also report ns/packet");
+
 #define DRIVER_NAME "ScreamALSA"
-static struct snd_card *scream_card_ptr = NULL;
+static struct snd_card *scream_cards[SCREAM_MAX_CARDS];
+static int scream_num_cards;
 static struct platform_device *scream_pdev = NULL;
+static struct workqueue_struct *scream_live_wq;     /* live switches, may sit in a connect */
 static const u8 ch_mask[] = {0, 1, 3, 7, 15, 31, 63, 127, 255};
 #define SCREAM_PAYLOAD_SIZE 1152
 #define SCREAM_HEADER_SIZE 5
 #define SCREAM_PACKET_SIZE (SCREAM_HEADER_SIZE + SCREAM_PAYLOAD_SIZE)
+#define SCREAM_MAX_BATCH 16
+#define SCREAM_ZC_SLOTS 4       /* TCP page-send buffers per card */
+#define SCREAM_FEC_PKT_MAX (SCREAM_FEC_HDR_SIZE + 4 * SCREAM_FEC_MAX_GROUP + SCREAM_MAX_PAYLOAD)
+#define SCREAM_BACKLOG_BYTES (2 * 1024 * 1024)  /* TCP backlog ring, tcp_backlog_ms is clamped to it */
+#define SCREAM_LZ4_STRIDE (SCREAM_EXT_HEADER_SIZE + SCREAM_LZ4_LEN_SIZE + \
+                           SCREAM_MAX_PAYLOAD + SCREAM_MAX_PAYLOAD / 255 + 16)  /* LZ4 worst case */
+#define SCREAM_LZ4_BACKOFF_MAX 256
+#define SCREAM_MAX_DESTS 8
+#define SCREAM_MAX_TARGETS 4    /* TCP receiver and its standbys */
+#define SCREAM_MIN_MTU 576
+#define SCREAM_MAX_MTU 9000
+#define SCREAM_IPV4_UDP_OVERHEAD 28
+#define SCREAM_MAX_PAYLOAD (SCREAM_MAX_MTU - SCREAM_IPV4_UDP_OVERHEAD - SCREAM_HEADER_SIZE)
+#define SCREAM_MAX_PACKET_SIZE (SCREAM_EXT_HEADER_SIZE + SCREAM_MAX_PAYLOAD)  /* room for the extension */
 
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
@@ -107,48 +338,267 @@ static const u8 ch_mask[] = {0, 1, 3, 7, 15, 31, 63, 127, 255};
 # define SCREAM_DMA_DATA snd_dma_continuous_data(GFP_KERNEL)
 #endif
 
+/* SYNC_APPLPTR makes ALSA call .ack for mmap writes too, which is what wakes
+ * a starved stream */
+#ifdef SNDRV_PCM_INFO_SYNC_APPLPTR
+#define SCREAM_INFO_FLAGS (SNDRV_PCM_INFO_INTERLEAVED | \
+                           SNDRV_PCM_INFO_MMAP | \
+                           SNDRV_PCM_INFO_MMAP_VALID | \
+                           SNDRV_PCM_INFO_SYNC_APPLPTR)
+#else
 #define SCREAM_INFO_FLAGS (SNDRV_PCM_INFO_INTERLEAVED | \
                            SNDRV_PCM_INFO_MMAP | \
                            SNDRV_PCM_INFO_MMAP_VALID)
+#endif
 
 /* HR timer logic removed, using kthread sleep instead */
 
+/* One RT thread serving every open stream on its list */
+struct scream_tx_engine {
+    struct task_struct *thread;
+    struct mutex lock;          /* protects streams, held while they are serviced */
+    struct list_head streams;
+    atomic_t kick;              /* set when a stream starts, rescans before sleeping */
+    int policy;                 /* SCHED_FIFO or SCHED_DEADLINE, as applied */
+    u64 dl_runtime_ns;          /* last reservation asked for */
+    u64 dl_period_ns;
+};
+
+static struct scream_tx_engine scream_engines[SCREAM_MAX_TX_THREADS];
+static int scream_num_engines;
+
+#define SCREAM_HIST_BUCKETS 16   /* log2 microseconds: <1, <2, <4 ... >=16384 */
+
+/* Written by the engine thread only; the proc file reads them unlocked and
+ * resets them under the engine lock. */
+struct scream_stats {
+    u64 packets;            /* datagrams or TCP packets accepted by the socket */
+    u64 bytes;
+    u64 drops;              /* -EAGAIN/-ENOBUFS, audio lost */
+    u64 partial_sends;      /* TCP short writes */
+    u64 underruns;          /* stream ran out of data */
+    u64 timeline_resets;    /* fell too far behind and restarted pacing */
+    u64 zc_packets;
+    u64 copy_packets;
+    u64 gso_sends;          /* UDP_SEGMENT sends, each carrying several packets */
+    u64 tcp_corked;         /* TCP batches sent with MSG_MORE */
+    u64 tcp_page_sends;     /* TCP batches sent from the page pool */
+    u64 tcp_pool_busy;      /* no pool buffer free, batch copied instead */
+    u64 bl_queued;          /* TCP packets that went through the backlog */
+    u64 bl_dropped;         /* ...and were dropped from it when full */
+    u64 bl_stalls;          /* wakeups that left audio in the ALSA buffer instead */
+    u64 bl_max;             /* deepest backlog seen, bytes */
+    u64 fec_sent;           /* parity datagrams accepted by the socket */
+    u64 silence_pkts;       /* packets folded into silence markers */
+    u64 silence_bytes;      /* wire bytes those markers saved */
+    u64 lz4_tries, lz4_ns;  /* compression attempts and the time they took */
+    u64 lz4_packets;        /* ...that went out compressed */
+    u64 lz4_in, lz4_out;    /* payload bytes of those, before and after */
+    u64 jit_samples, jit_sum_ns, jit_max_ns;    /* inter-packet interval error */
+    u64 late_sum_ns, late_max_ns;               /* wakeup past the due time */
+    u64 send_hist[SCREAM_HIST_BUCKETS];         /* time spent in sendmsg per batch */
+    u64 late_hist[SCREAM_HIST_BUCKETS];         /* pacing error */
+};
+
+/* One receiver of a card's stream */
+struct scream_dest {
+    struct sockaddr_in addr;
+    atomic64_t packets;
+    atomic64_t errors;
+    int last_err;
+};
+
+enum {
+    SCREAM_TGT_IDLE,        /* no socket, waiting for the next try */
+    SCREAM_TGT_CONNECTING,
+    SCREAM_TGT_READY,       /* connected, nothing sent on it yet */
+    SCREAM_TGT_DEAD,        /* failed as the active receiver, to be released */
+};
+
+/* Where and how a card sends, as its controls ask for it */
+struct scream_live_cfg {
+    struct sockaddr_in addr;
+    bool is_tcp;
+    bool adaptive;          /* payload policy */
+    unsigned int batch;     /* 0 = tx_batch */
+};
+
+/* A candidate TCP receiver; the active one's socket is dev->sock */
+struct scream_target {
+    struct sockaddr_in addr;
+    struct socket *sock;
+    int state;
+    unsigned int fails;     /* in a row, sets the retry backoff */
+    unsigned long since;    /* jiffies: connect started, or next try when idle */
+};
+
 struct snd_scream_device {
     struct snd_card *card;
     struct snd_pcm *pcm;
     struct snd_pcm_substream *substream;
+    int index;              /* card number within this module */
 
     struct socket *sock;
     struct sockaddr_in remote_addr;
     bool is_tcp;
+    bool udp_gso;           /* cleared for the stream if the route cannot segment */
+    struct scream_dest dests[SCREAM_MAX_DESTS];    /* dests[0] is remote_addr */
+    unsigned int num_dests;
 
     spinlock_t lock;
-    wait_queue_head_t playback_waitq;
-    struct task_struct *playback_thread;
+    struct mutex tx_mutex;  /* held while the tx thread reads the DMA ring */
+    struct scream_tx_engine *engine;
+    struct list_head tx_node;   /* on engine->streams while the PCM is open */
+    bool on_engine;
+    bool tx_first;          /* no packet sent since start */
+    bool tx_starved;        /* waiting for the application, .ack wakes us */
+    ktime_t next_wake;      /* when the stream is due again */
+    ktime_t tx_anchor;      /* timeline origin, moved a second at a time */
+    u64 tx_bytes;           /* ring bytes sent since tx_anchor */
+    u64 byte_rate;          /* ring bytes per second */
+    ktime_t last_tx;
+    unsigned int last_npkts;
+    s64 trim_ppb;           /* feedback correction, > 0 sends faster */
+    s64 fb_integral;
+    u32 fb_fill_us;         /* last reported receiver fill */
+    u64 fb_reports;
+    ktime_t fb_next_poll;
+    u8 fb_buf[64];          /* partial records from the TCP stream */
+    unsigned int fb_len;
     ktime_t period_time_ns;
-    size_t hw_ptr;          /* in bytes */
+    size_t hw_ptr;          /* in bytes, written by the engine, read locklessly */
     bool is_running;
-    u8 network_buffer[SCREAM_PACKET_SIZE];
+    u8 *network_buffer;     /* SCREAM_MAX_BATCH packets, header + payload each */
+    size_t payload_size;    /* bytes of audio per packet for the current stream */
+    size_t packet_size;     /* header + payload, also the stride in network_buffer */
+    unsigned int tx_batch;  /* packets per wakeup for the current stream */
+    struct kvec tx_iov[SCREAM_MAX_BATCH * 3];   /* header + up to two ring segments */
+    unsigned int tx_nvec[SCREAM_MAX_BATCH];     /* kvecs used by each packet */
+    u32 tx_short;                               /* bit i: packet i is a silence marker or compressed */
+    u8 *lz4_buf;            /* SCREAM_MAX_BATCH compressed packets, then one gathered payload */
+    void *lz4_wrk;
+    unsigned int lz4_skip;  /* packets left before compression is tried again */
+    unsigned int lz4_backoff;
+    size_t hdr_size;        /* SCREAM_HEADER_SIZE, or SCREAM_EXT_HEADER_SIZE with ext_on */
+    bool ext_on;            /* packets carry the extended header */
+    bool ext_asked;         /* a receiver asked for it this stream */
+    u32 tx_seq;
+    u64 tx_frames;          /* frames sent since prepare */
+    bool corked;            /* TCP: bytes held back with MSG_MORE */
+    ktime_t cork_start;
+    struct page *zc_pool[SCREAM_ZC_SLOTS];  /* free again once the stack drops its references */
+    unsigned int zc_order;  /* of each pool buffer, sized for the stream's batch */
+    unsigned int zc_next;
+    struct page *tx_page;   /* pool buffer holding the current batch, or NULL */
+    u8 *bl_buf;             /* TCP backlog, SCREAM_BACKLOG_BYTES ring */
+    size_t bl_head;         /* oldest unsent byte */
+    size_t bl_len;
+    size_t bl_rem;          /* rest of a partly sent packet at bl_head */
+    size_t bl_pkt;          /* size of the whole packets queued after it */
+    size_t bl_limit;        /* tcp_backlog_ms worth of wire bytes */
+    s64 bl_conn;            /* conn_gen the queued bytes belong to */
+    unsigned int fec_n;     /* UDP FEC group size, 0 = off */
+    unsigned int fec_k;     /* parities per group */
+    unsigned int fec_fill;  /* packets in the current group */
+    u32 fec_seq;
+    u32 fec_hash[SCREAM_FEC_MAX_GROUP];
+    u8 *fec_buf;            /* fec_k parity datagrams, SCREAM_FEC_PKT_MAX apart */
+    struct scream_stats stats;
+    atomic64_t reconnects;
+    atomic64_t conn_gen;    /* bumped whenever sock is replaced; not a statistic */
+    atomic64_t failovers;   /* switches to a standby TCP receiver */
+    u8 *last_buffer;        /* end-of-track packet */
 
     unsigned int sample_rate;
     unsigned int channels;
     snd_pcm_format_t format;
     bool is_dsd;
+    unsigned int frame_bytes;       /* ring frame size for the negotiated format */
+    unsigned int src_sample_bytes;  /* one sample in the ring */
+    unsigned int wire_sample_bytes; /* one sample on the wire */
+    bool needs_convert;             /* ring format differs from the wire format */
+    size_t src_payload_size;        /* ring bytes consumed per packet */
 
     struct delayed_work reconnect_work;
     atomic_t connection_state;
     atomic_t reconnect_attempts;
     atomic_t closing;        /* set to 1 during close to stop reconnect rescheduling */
+    struct scream_target targets[SCREAM_MAX_TARGETS];   /* [0] is the configured receiver */
+    unsigned int num_targets;   /* 0 or 1 = no standbys */
+    unsigned int fo_active;     /* target dev->sock is connected to */
+    struct mutex fo_lock;       /* protects targets */
+    struct delayed_work fo_work;
+    struct scream_live_cfg live;    /* requested through the controls */
+    bool live_set;                  /* controls override the module params */
+    struct mutex live_lock;         /* protects live and the switch itself */
+    struct delayed_work live_work;
+    u32 live_seq;                   /* switches applied */
+    struct snd_kcontrol *live_ctls[6];
+    bool adaptive;                  /* payload policy of the current stream */
+    unsigned int batch_cfg;         /* 0 = tx_batch */
 
     /* Flexible periods natively supported */
     size_t alsa_period_bytes;
     size_t bytes_in_period;
+
+    /* Capture */
+    struct snd_pcm_substream *cap_substream;
+    struct socket *cap_sock;        /* UDP socket or TCP listener */
+    struct socket *cap_conn;        /* accepted TCP sender */
+    bool cap_tcp;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+    void (*cap_orig_data_ready)(struct sock *sk);
+#else
+    void (*cap_orig_data_ready)(struct sock *sk, int bytes);
+#endif
+    struct work_struct cap_work;
+    struct mutex cap_mutex;         /* held while the work writes the ring */
+    atomic_t cap_running;
+    bool cap_priming;               /* filling the jitter buffer */
+    bool cap_seen;
+    ktime_t cap_last_rx;
+    snd_pcm_uframes_t cap_rx_frames;        /* written into the ring, mod boundary */
+    snd_pcm_uframes_t cap_hw_frames;        /* handed to ALSA, mod boundary */
+    snd_pcm_uframes_t cap_period_frames;
+    snd_pcm_uframes_t cap_prefill_frames;
+    u8 cap_hdr[SCREAM_HEADER_SIZE];
+    unsigned int cap_off;           /* TCP: bytes of the current packet received */
+    bool cap_drop;                  /* TCP: current payload is discarded */
+    u8 *cap_scratch;                /* sink for payloads that are not kept */
+    struct {
+        u64 packets;
+        u64 bytes;
+        u64 overruns;               /* ring full, packet dropped */
+        u64 mismatches;             /* header does not match the capture format */
+        u64 gaps;                   /* silence longer than the jitter buffer */
+    } cap_stats;
 };
 
+/* hw_ptr moves only after the bytes behind it have been read out of the ring,
+ * so .pointer can read it without a lock */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+#define scream_read_hw_ptr(dev)         READ_ONCE((dev)->hw_ptr)
+#define scream_publish_hw_ptr(dev, v)   smp_store_release(&(dev)->hw_ptr, v)
+#else
+#define scream_read_hw_ptr(dev)         ACCESS_ONCE((dev)->hw_ptr)
+#define scream_publish_hw_ptr(dev, v)   do { smp_mb(); ACCESS_ONCE((dev)->hw_ptr) = (v); } while (0)
+#endif
+
+/* Same for the capture side, where the receive work is the writer */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+#define scream_read_cap_frames(dev)         READ_ONCE((dev)->cap_hw_frames)
+#define scream_publish_cap_frames(dev, v)   smp_store_release(&(dev)->cap_hw_frames, v)
+#else
+#define scream_read_cap_frames(dev)         ACCESS_ONCE((dev)->cap_hw_frames)
+#define scream_publish_cap_frames(dev, v)   do { smp_mb(); ACCESS_ONCE((dev)->cap_hw_frames) = (v); } while (0)
+#endif
+
 static struct snd_pcm_hardware snd_scream_hw = {
     .info = SCREAM_INFO_FLAGS,
     .formats =
-        (SNDRV_PCM_FMTBIT_S32_LE
+        (SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_S16_LE |
+         SNDRV_PCM_FMTBIT_S24_LE | SNDRV_PCM_FMTBIT_S24_3LE |
+         SNDRV_PCM_FMTBIT_FLOAT_LE
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
 #ifdef SNDRV_PCM_FMTBIT_DSD_U32_BE
          | SNDRV_PCM_FMTBIT_DSD_U32_BE
@@ -186,6 +636,294 @@ static void convert_data(char*src, int frames)
         }
 }
 
+/* IEEE-754 single in [-1.0, 1.0) to S32 without touching the FPU */
+static inline u32 scream_float_to_s32(u32 f)
+{
+    u32 exp = (f >> 23) & 0xff;
+    u32 mag = (f & 0x7fffff) | 0x800000;
+    bool neg = f >> 31;
+
+    if (exp < 95)
+        return 0;
+    if (exp >= 127)
+        return neg ? 0x80000000u : 0x7fffffffu;
+    /* value * 2^31 = mantissa * 2^(exp - 119) */
+    mag = (exp >= 119) ? mag << (exp - 119) : mag >> (119 - exp);
+    return neg ? (u32)(-(s32)mag) : mag;
+}
+
+/* Copy src_len ring bytes into a packet, widening to 32-bit little-endian
+ * samples when the ring format differs from the wire. Ring positions always
+ * sit on sample boundaries, so each wrap segment converts on its own.
+ * Returns the number of bytes written. */
+static size_t scream_copy_samples(struct snd_scream_device *dev, u8 *dst,
+                                  const u8 *src, size_t src_len)
+{
+    size_t n = src_len / dev->src_sample_bytes;
+    size_t i;
+
+    if (!dev->needs_convert) {
+        memcpy(dst, src, src_len);
+        return src_len;
+    }
+
+    switch (dev->format) {
+    case SNDRV_PCM_FORMAT_S16_LE:
+        for (i = 0; i < n; i++, src += 2, dst += 4) {
+            dst[0] = 0;
+            dst[1] = 0;
+            dst[2] = src[0];
+            dst[3] = src[1];
+        }
+        break;
+    case SNDRV_PCM_FORMAT_S24_3LE:
+        for (i = 0; i < n; i++, src += 3, dst += 4) {
+            dst[0] = 0;
+            dst[1] = src[0];
+            dst[2] = src[1];
+            dst[3] = src[2];
+        }
+        break;
+    case SNDRV_PCM_FORMAT_S24_LE:
+        /* 24 valid bits in the low bytes of a 32-bit container */
+        for (i = 0; i < n; i++, src += 4, dst += 4) {
+            dst[0] = 0;
+            dst[1] = src[0];
+            dst[2] = src[1];
+            dst[3] = src[2];
+        }
+        break;
+    case SNDRV_PCM_FORMAT_FLOAT_LE:
+        for (i = 0; i < n; i++, src += 4, dst += 4) {
+            __le32 v;
+            memcpy(&v, src, 4);
+            v = cpu_to_le32(scream_float_to_s32(le32_to_cpu(v)));
+            memcpy(dst, &v, 4);
+        }
+        break;
+    default:
+        memcpy(dst, src, src_len);
+        return src_len;
+    }
+    return n * dev->wire_sample_bytes;
+}
+
+/* ------------------------------
+ *      DSD byte shuffle (SIMD)
+ * ------------------------------ */
+enum {
+    SCREAM_DSD_SCALAR,
+    SCREAM_DSD_SSSE3,
+    SCREAM_DSD_AVX2,
+    SCREAM_DSD_NEON,
+};
+
+static const char * const scream_dsd_impl_names[] = {
+    "scalar", "ssse3", "avx2", "neon",
+};
+
+static int scream_dsd_impl = SCREAM_DSD_SCALAR;
+
+/* convert_data() as a byte permutation of two 8-byte groups */
+static const u8 scream_dsd_shuf[32] __aligned(32) = {
+    0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15,
+    0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15,
+};
+
+/*
+ * The vector registers are left alone by the compiler in kernel code, so
+ * like lib/raid6 the mask is loaded once per kernel_fpu/neon section and
+ * reused by the following asm statements. Each step handles 64 bytes
+ * (8 groups); the tail goes through the scalar loop.
+ */
+#ifdef SCREAM_SIMD_X86
+static void convert_data_ssse3(char *src, int frames)
+{
+    int blocks = frames / 8;
+
+    kernel_fpu_begin();
+    asm volatile("movdqu %0, %%xmm7" : : "m" (scream_dsd_shuf[0]));
+    for (; blocks; blocks--, src += 64) {
+        asm volatile("movdqu   0(%0), %%xmm0\n\t"
+                     "movdqu  16(%0), %%xmm1\n\t"
+                     "movdqu  32(%0), %%xmm2\n\t"
+                     "movdqu  48(%0), %%xmm3\n\t"
+                     "pshufb  %%xmm7, %%xmm0\n\t"
+                     "pshufb  %%xmm7, %%xmm1\n\t"
+                     "pshufb  %%xmm7, %%xmm2\n\t"
+                     "pshufb  %%xmm7, %%xmm3\n\t"
+                     "movdqu  %%xmm0,  0(%0)\n\t"
+                     "movdqu  %%xmm1, 16(%0)\n\t"
+                     "movdqu  %%xmm2, 32(%0)\n\t"
+                     "movdqu  %%xmm3, 48(%0)"
+                     : : "r" (src) : "memory");
+    }
+    kernel_fpu_end();
+    convert_data(src, frames % 8);
+}
+
+#ifdef SCREAM_SIMD_AVX2
+static void convert_data_avx2(char *src, int frames)
+{
+    int blocks = frames / 8;
+
+    kernel_fpu_begin();
+    asm volatile("vmovdqu %0, %%ymm7" : : "m" (scream_dsd_shuf[0]));
+    for (; blocks; blocks--, src += 64) {
+        asm volatile("vmovdqu  0(%0), %%ymm0\n\t"
+                     "vmovdqu 32(%0), %%ymm1\n\t"
+                     "vpshufb %%ymm7, %%ymm0, %%ymm0\n\t"
+                     "vpshufb %%ymm7, %%ymm1, %%ymm1\n\t"
+                     "vmovdqu %%ymm0,  0(%0)\n\t"
+                     "vmovdqu %%ymm1, 32(%0)"
+                     : : "r" (src) : "memory");
+    }
+    asm volatile("vzeroupper");
+    kernel_fpu_end();
+    convert_data(src, frames % 8);
+}
+#endif
+#endif /* SCREAM_SIMD_X86 */
+
+#ifdef SCREAM_SIMD_NEON
+static void convert_data_neon(char *src, int frames)
+{
+    int blocks = frames / 8;
+
+    kernel_neon_begin();
+    asm volatile("ld1 {v7.16b}, [%0]" : : "r" (scream_dsd_shuf) : "memory");
+    for (; blocks; blocks--, src += 64) {
+        asm volatile("ld1 {v0.16b-v3.16b}, [%0]\n\t"
+                     "tbl v0.16b, {v0.16b}, v7.16b\n\t"
+                     "tbl v1.16b, {v1.16b}, v7.16b\n\t"
+                     "tbl v2.16b, {v2.16b}, v7.16b\n\t"
+                     "tbl v3.16b, {v3.16b}, v7.16b\n\t"
+                     "st1 {v0.16b-v3.16b}, [%0]"
+                     : : "r" (src) : "memory");
+    }
+    kernel_neon_end();
+    convert_data(src, frames % 8);
+}
+#endif
+
+/* Rearrange DSD groups in place with the implementation picked at load */
+static void scream_convert_dsd(char *src, int frames)
+{
+#if defined(SCREAM_SIMD_X86) || defined(SCREAM_SIMD_NEON)
+    if (frames >= 8 && may_use_simd()) {
+        switch (scream_dsd_impl) {
+#ifdef SCREAM_SIMD_X86
+        case SCREAM_DSD_SSSE3:
+            convert_data_ssse3(src, frames);
+            return;
+#ifdef SCREAM_SIMD_AVX2
+        case SCREAM_DSD_AVX2:
+            convert_data_avx2(src, frames);
+            return;
+#endif
+#endif
+#ifdef SCREAM_SIMD_NEON
+        case SCREAM_DSD_NEON:
+            convert_data_neon(src, frames);
+            return;
+#endif
+        default:
+            break;
+        }
+    }
+#endif
+    convert_data(src, frames);
+}
+
+/* Pick the fastest shuffle the CPU offers and cross-check it against the
+ * scalar loop. Any mismatch falls back to scalar for the module lifetime. */
+static void scream_dsd_select(void)
+{
+    const int groups = 8 * 64 + 5;    /* exercises the block loop and the tail */
+    char *ref, *test;
+
+    scream_dsd_impl = SCREAM_DSD_SCALAR;
+    if (!dsd_simd)
+        goto out;
+#ifdef SCREAM_SIMD_X86
+#ifdef SCREAM_SIMD_AVX2
+    if (boot_cpu_has(X86_FEATURE_AVX) && boot_cpu_has(X86_FEATURE_AVX2))
+        scream_dsd_impl = SCREAM_DSD_AVX2;
+    else
+#endif
+    if (boot_cpu_has(X86_FEATURE_SSSE3))
+        scream_dsd_impl = SCREAM_DSD_SSSE3;
+#endif
+#ifdef SCREAM_SIMD_NEON
+    scream_dsd_impl = SCREAM_DSD_NEON;
+#endif
+    if (scream_dsd_impl == SCREAM_DSD_SCALAR)
+        goto out;
+
+    ref = kmalloc(groups * 8, GFP_KERNEL);
+    test = kmalloc(groups * 8, GFP_KERNEL);
+    if (!ref || !test) {
+        scream_dsd_impl = SCREAM_DSD_SCALAR;
+    } else {
+        get_random_bytes(ref, groups * 8);
+        memcpy(test, ref, groups * 8);
+        convert_data(ref, groups);
+        scream_convert_dsd(test, groups);
+        if (memcmp(ref, test, groups * 8)) {
+            pr_warn(DRIVER_NAME ": %s DSD shuffle failed self-test, using scalar\n",
+                    scream_dsd_impl_names[scream_dsd_impl]);
+            scream_dsd_impl = SCREAM_DSD_SCALAR;
+        }
+    }
+    kfree(ref);
+    kfree(test);
+out:
+    pr_info(DRIVER_NAME ": DSD shuffle: %s\n", scream_dsd_impl_names[scream_dsd_impl]);
+}
+
+static bool scream_adaptive_payload(void)
+{
+    return sysfs_streq(payload_policy, "adaptive");
+}
+
+/* Largest payload the adaptive policy may choose: one datagram per MTU.
+ * With FEC (fec_n > 0) the parity datagram, whose header carries the group's
+ * hashes, must fit as well. */
+static size_t scream_max_payload(bool adaptive, unsigned int fec_n)
+{
+    size_t hdr = ext_header ? SCREAM_EXT_HEADER_SIZE : SCREAM_HEADER_SIZE;
+
+    if (!adaptive)
+        return SCREAM_PAYLOAD_SIZE;
+    if (fec_n)
+        hdr = max_t(size_t, hdr, SCREAM_FEC_HDR_SIZE + 4 * fec_n);
+    return clamp(mtu, SCREAM_MIN_MTU, SCREAM_MAX_MTU) - SCREAM_IPV4_UDP_OVERHEAD - hdr;
+}
+
+/* Payload bytes per packet for a stream. 'fixed' keeps the legacy 1152 bytes.
+ * 'adaptive' uses whole frames: the legacy size, grown as needed to stay
+ * under max_pps, or the whole MTU when no rate cap is set. DSD payloads also
+ * stay a multiple of the 8-byte group rearranged by convert_data(). */
+static size_t scream_payload_for_stream(bool adaptive, unsigned int rate, unsigned int frame_bytes,
+                                        bool is_dsd, unsigned int fec_n)
+{
+    size_t unit = frame_bytes;
+    size_t limit, payload;
+
+    if (!adaptive || !frame_bytes)
+        return SCREAM_PAYLOAD_SIZE;
+
+    if (is_dsd && (unit % 8))
+        unit *= 2;
+    limit = rounddown(scream_max_payload(true, fec_n), unit);
+    if (max_pps <= 0)
+        return limit;
+
+    payload = roundup(DIV_ROUND_UP((u64)rate * frame_bytes, (u32)max_pps), unit);
+    payload = max_t(size_t, payload, rounddown(SCREAM_PAYLOAD_SIZE, unit));
+    return clamp_t(size_t, payload, unit, limit);
+}
+
 static inline void set_sock_timeouts(struct socket *sock, unsigned int msec)
 {
     struct sock *sk = sock->sk;
@@ -213,6 +951,15 @@ static inline void set_sock_timeouts(struct socket *sock, unsigned int msec)
     kernel_setsockopt(sock, level, optname, (char *)(optval), optlen)
 #endif
 
+/* sock_setsockopt only knows SOL_SOCKET, IP and TCP options go through the protocol */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+#define SET_PROTO_SOCKOPT(sock, level, optname, optval, optlen) \
+    (sock)->ops->setsockopt(sock, level, optname, KERNEL_SOCKPTR(optval), optlen)
+#else
+#define SET_PROTO_SOCKOPT(sock, level, optname, optval, optlen) \
+    kernel_setsockopt(sock, level, optname, (char *)(optval), optlen)
+#endif
+
 /* Socket creation compatibility */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
     #define SCREAM_SOCK_CREATE(af, type, proto, sock) \
@@ -224,73 +971,509 @@ static inline void set_sock_timeouts(struct socket *sock, unsigned int msec)
 
 /* hrtimer_forward function removed */
 
-static void scream_cleanup_resources(struct snd_scream_device *dev)
+/* Card 0 follows the global parameters; further cards override them through
+ * the per-card arrays and default to consecutive ports. */
+static const char *scream_card_ip(int idx)
 {
-    unsigned long flags;
-    struct task_struct *thd = NULL;
-    spin_lock_irqsave(&dev->lock, flags);
-    if (dev->is_running) {
-        dev->is_running = false;
-    }
-    thd = dev->playback_thread;
-    dev->playback_thread = NULL;
-    spin_unlock_irqrestore(&dev->lock, flags);
-    
-    if (thd) {
-        kthread_stop(thd);
-    }
+    return (ip_addrs[idx] && *ip_addrs[idx]) ? ip_addrs[idx] : ip_addr_str;
+}
 
-    cancel_delayed_work_sync(&dev->reconnect_work);
-    /* Close socket with proper TCP shutdown */
-    if (dev->sock) {
-        if (dev->is_tcp && atomic_read(&dev->connection_state) == STATE_CONNECTED) {
-            dev->sock->ops->shutdown(dev->sock, SHUT_WR);
+static int scream_card_port(int idx)
+{
+    return ports[idx] > 0 ? ports[idx] : port + idx;
+}
+
+static bool scream_card_is_tcp(int idx)
+{
+    return sysfs_streq((protocols[idx] && *protocols[idx]) ? protocols[idx] : protocol_str, "tcp");
+}
+
+static void scream_dest_init(struct scream_dest *dst, const struct sockaddr_in *addr)
+{
+    dst->addr = *addr;
+    atomic64_set(&dst->packets, 0);
+    atomic64_set(&dst->errors, 0);
+    dst->last_err = 0;
+}
+
+/* "ip[:port]" into addr; addr keeps its port when none is given */
+static bool scream_parse_addr(const char *tok, struct sockaddr_in *addr)
+{
+    const char *end;
+    u16 p;
+
+    if (!in4_pton(tok, -1, (u8 *)&addr->sin_addr.s_addr, ':', &end) ||
+        (*end == ':' && (kstrtou16(end + 1, 10, &p) || !p)))
+        return false;
+    if (*end == ':')
+        addr->sin_port = htons(p);
+    return true;
+}
+
+/* The card's own destination followed by its fanout list. Every packet is
+ * built once and handed to the socket for each receiver in turn. */
+static void scream_setup_dests(struct snd_scream_device *dev)
+{
+    const char *list = fanout[dev->index];
+    unsigned int n = 0;
+
+    scream_dest_init(&dev->dests[n++], &dev->remote_addr);
+
+    if (list && *list && dev->is_tcp) {
+        pr_warn(DRIVER_NAME ": card %d: fanout is only used with UDP\n", dev->index);
+    } else if (list && *list) {
+        char *buf = kstrdup(list, GFP_KERNEL);
+        char *cur = buf, *tok;
+
+        while (buf && (tok = strsep(&cur, ";")) != NULL) {
+            struct sockaddr_in addr = dev->remote_addr;
+
+            tok = strim(tok);
+            if (!*tok)
+                continue;
+            if (n == SCREAM_MAX_DESTS) {
+                pr_warn(DRIVER_NAME ": card %d: more than %d destinations, ignoring the rest\n",
+                        dev->index, SCREAM_MAX_DESTS);
+                break;
+            }
+            if (!scream_parse_addr(tok, &addr)) {
+                pr_warn(DRIVER_NAME ": card %d: bad fanout destination '%s'\n", dev->index, tok);
+                continue;
+            }
+            scream_dest_init(&dev->dests[n++], &addr);
         }
-        sock_release(dev->sock);
-        dev->sock = NULL;
+        kfree(buf);
     }
-
-    /* Reset all state atomically */
-    atomic_set(&dev->connection_state, STATE_DISCONNECTED);
-    atomic_set(&dev->reconnect_attempts, 0);
-    spin_lock_irqsave(&dev->lock, flags);
-    dev->is_running = false;
-    dev->substream = NULL;
-    spin_unlock_irqrestore(&dev->lock, flags);
+    dev->num_dests = n;
 }
 
-static void scream_reconnect_work(struct work_struct *work)
+/* Audio ports of card idx: its own and its fanout list's. Fills out[], at
+ * most SCREAM_MAX_DESTS, and returns the count. */
+static unsigned int scream_card_audio_ports(int idx, u16 *out)
 {
-    struct snd_scream_device *dev = container_of(to_delayed_work(work),
-                                                 struct snd_scream_device,
-                                                 reconnect_work);
-    int ret;
-    if (!dev->is_tcp)
-        return;
-    if (atomic_read(&dev->closing))
-        return;
+    const char *list = fanout[idx];
+    unsigned int n = 0;
 
-    pr_info("Called scream_reconnect_work.\n");
-    switch (atomic_read(&dev->connection_state)) {
-    case STATE_CONNECTED:
-        /* Nothing to do */
-        return;
+    out[n++] = scream_card_port(idx);
+    if (list && *list && !scream_card_is_tcp(idx)) {
+        char *buf = kstrdup(list, GFP_KERNEL);
+        char *cur = buf, *tok;
 
-    case STATE_CONNECTING:
-        /* Poll non-blocking connect progress without recreating the socket */
-        if (!dev->sock || !dev->sock->sk) {
-            atomic_set(&dev->connection_state, STATE_DISCONNECTED);
-            if (!atomic_read(&dev->closing))
-                schedule_delayed_work(&dev->reconnect_work, msecs_to_jiffies(200));
-            return;
+        while (buf && n < SCREAM_MAX_DESTS && (tok = strsep(&cur, ";")) != NULL) {
+            struct sockaddr_in addr = { .sin_port = htons(out[0]) };
+
+            tok = strim(tok);
+            if (*tok && scream_parse_addr(tok, &addr))
+                out[n++] = ntohs(addr.sin_port);
         }
+        kfree(buf);
+    }
+    return n;
+}
 
-        if (dev->sock->sk->sk_state == TCP_ESTABLISHED) {
-            set_sock_timeouts(dev->sock, 5000);
-            atomic_set(&dev->connection_state, STATE_CONNECTED);
-            atomic_set(&dev->reconnect_attempts, 0);
-            pr_info(DRIVER_NAME ": TCP reconnected successfully.\n");
-            return;
+/* Parity for a receiver on audio port p */
+static u16 scream_fec_port(int idx, u16 p)
+{
+    return fec_ports[idx] > 0 ? fec_ports[idx] : p + 1;
+}
+
+/* With consecutive card ports, port + 1 is the next card's: a legacy
+ * receiver there would play the parity as audio. */
+static bool scream_fec_port_clash(int idx)
+{
+    u16 mine[SCREAM_MAX_DESTS], theirs[SCREAM_MAX_DESTS];
+    unsigned int n, m, i, k;
+    int j;
+
+    n = scream_card_audio_ports(idx, mine);
+    for (j = 0; j < scream_num_cards; j++) {
+        m = scream_card_audio_ports(j, theirs);
+        for (i = 0; i < n; i++) {
+            for (k = 0; k < m; k++) {
+                if (scream_fec_port(idx, mine[i]) != theirs[k])
+                    continue;
+                pr_warn(DRIVER_NAME ": card %d: FEC parity port %u is an audio port of card %d, "
+                        "sending without FEC (set fec_ports)\n", idx, theirs[k], j);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void scream_setup_multicast(struct snd_scream_device *dev)
+{
+    unsigned int i;
+    int ttl, ret;
+
+    for (i = 0; i < dev->num_dests; i++)
+        if (ipv4_is_multicast(dev->dests[i].addr.sin_addr.s_addr))
+            break;
+    if (i == dev->num_dests)
+        return;
+
+    ttl = clamp_t(int, mcast_ttl, 0, 255);
+    ret = SET_PROTO_SOCKOPT(dev->sock, SOL_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    if (ret < 0)
+        pr_warn(DRIVER_NAME ": Failed to set IP_MULTICAST_TTL: %d\n", ret);
+
+    if (mcast_if[0]) {
+        struct ip_mreqn mreq;
+        struct net_device *ndev = dev_get_by_name(&init_net, mcast_if);
+
+        if (!ndev) {
+            pr_warn(DRIVER_NAME ": Multicast interface %s not found\n", mcast_if);
+            return;
+        }
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.imr_ifindex = ndev->ifindex;
+        dev_put(ndev);
+        ret = SET_PROTO_SOCKOPT(dev->sock, SOL_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq));
+        if (ret < 0)
+            pr_warn(DRIVER_NAME ": Failed to set IP_MULTICAST_IF: %d\n", ret);
+    }
+}
+
+static void scream_tx_kick(struct snd_scream_device *dev)
+{
+    struct scream_tx_engine *eng = dev->engine;
+
+    atomic_set(&eng->kick, 1);
+    if (eng->thread)
+        wake_up_process(eng->thread);
+}
+
+static void scream_tx_attach(struct snd_scream_device *dev)
+{
+    struct scream_tx_engine *eng = dev->engine;
+
+    mutex_lock(&eng->lock);
+    if (!dev->on_engine) {
+        dev->tx_first = true;
+        dev->tx_starved = false;
+        list_add_tail(&dev->tx_node, &eng->streams);
+        dev->on_engine = true;
+    }
+    mutex_unlock(&eng->lock);
+}
+
+/* Once this returns the engine no longer touches the device */
+static void scream_tx_detach(struct snd_scream_device *dev)
+{
+    struct scream_tx_engine *eng = dev->engine;
+
+    mutex_lock(&eng->lock);
+    if (dev->on_engine) {
+        list_del_init(&dev->tx_node);
+        dev->on_engine = false;
+    }
+    mutex_unlock(&eng->lock);
+}
+
+/* ------------------------------
+ *      TCP standby receivers
+ * ------------------------------ */
+#define SCREAM_CONNECT_TIMEOUT_MS 3000
+#define SCREAM_RETRY_SLOW_MS 5000       /* reconnect interval after 10 failed attempts */
+
+static const char *const scream_target_states[] = { "idle", "connecting", "ready", "dead" };
+
+static void scream_tcp_sockopts(struct socket *sock)
+{
+    int opt = 1;
+    int ret;
+
+    ret = SET_PROTO_SOCKOPT(sock, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (ret < 0)
+        pr_warn(DRIVER_NAME ": Failed to set TCP_NODELAY: %d\n", ret);
+
+    ret = SET_SOCKOPT(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+    if (ret < 0)
+        pr_warn(DRIVER_NAME ": Failed to set SO_KEEPALIVE: %d\n", ret);
+
+    opt = 3000;
+    ret = SET_PROTO_SOCKOPT(sock, SOL_TCP, TCP_USER_TIMEOUT, &opt, sizeof(opt));
+    if (ret < 0)
+        pr_warn(DRIVER_NAME ": Failed to set TCP_USER_TIMEOUT: %d\n", ret);
+}
+
+/* targets[0] is the card's own receiver, then its standby list. Parsed once
+ * per card; after a failover remote_addr follows the active target. */
+static void scream_setup_targets(struct snd_scream_device *dev)
+{
+    const char *list = standby[dev->index];
+
+    if (!dev->num_targets && list && *list) {
+        char *buf = kstrdup(list, GFP_KERNEL);
+        char *cur = buf, *tok;
+        unsigned int n = 1;
+
+        memset(dev->targets, 0, sizeof(dev->targets));
+        dev->targets[0].addr = dev->remote_addr;
+        while (buf && (tok = strsep(&cur, ";")) != NULL) {
+            struct sockaddr_in addr = dev->remote_addr;
+
+            tok = strim(tok);
+            if (!*tok)
+                continue;
+            if (n == SCREAM_MAX_TARGETS) {
+                pr_warn(DRIVER_NAME ": card %d: more than %d standby receivers, ignoring the rest\n",
+                        dev->index, SCREAM_MAX_TARGETS - 1);
+                break;
+            }
+            if (!scream_parse_addr(tok, &addr)) {
+                pr_warn(DRIVER_NAME ": card %d: bad standby receiver '%s'\n", dev->index, tok);
+                continue;
+            }
+            dev->targets[n].addr = addr;
+            dev->targets[n].since = jiffies;
+            n++;
+        }
+        kfree(buf);
+        dev->fo_active = 0;
+        dev->num_targets = n;
+    }
+    if (dev->num_targets > 1)
+        dev->remote_addr = dev->targets[dev->fo_active].addr;
+}
+
+/* Close a standby and schedule its next try, backing off while it keeps failing */
+static void scream_target_drop(struct scream_target *t)
+{
+    unsigned int ms = clamp(tcp_health_ms, 50, 10000);
+
+    if (t->sock) {
+        kernel_sock_shutdown(t->sock, SHUT_RDWR);
+        sock_release(t->sock);
+        t->sock = NULL;
+    }
+    t->state = SCREAM_TGT_IDLE;
+    t->fails++;
+    t->since = jiffies + msecs_to_jiffies(min(ms << min(t->fails, 5u), 10000u));
+}
+
+static int scream_target_connect(struct scream_target *t)
+{
+    int opt, ret;
+
+    ret = SCREAM_SOCK_CREATE(AF_INET, SOCK_STREAM, IPPROTO_TCP, &t->sock);
+    if (ret < 0) {
+        t->sock = NULL;
+        return ret;
+    }
+    scream_tcp_sockopts(t->sock);
+    /* An idle standby only learns its receiver vanished from keepalives;
+     * probe within seconds instead of the two-hour default */
+    opt = 1;
+    SET_PROTO_SOCKOPT(t->sock, SOL_TCP, TCP_KEEPIDLE, &opt, sizeof(opt));
+    SET_PROTO_SOCKOPT(t->sock, SOL_TCP, TCP_KEEPINTVL, &opt, sizeof(opt));
+    opt = 3;
+    SET_PROTO_SOCKOPT(t->sock, SOL_TCP, TCP_KEEPCNT, &opt, sizeof(opt));
+
+    ret = kernel_connect(t->sock, (struct sockaddr *)&t->addr, sizeof(t->addr), O_NONBLOCK);
+    if (ret && ret != -EINPROGRESS)
+        return ret;
+    t->state = SCREAM_TGT_CONNECTING;
+    t->since = jiffies;
+    return 0;
+}
+
+/* Health check: keep a connection open to every standby, so a failover
+ * only has to swap sockets */
+static void scream_standby_work(struct work_struct *work)
+{
+    struct snd_scream_device *dev = container_of(to_delayed_work(work),
+                                                 struct snd_scream_device, fo_work);
+    bool ready = false;
+    unsigned int i;
+
+    mutex_lock(&dev->fo_lock);
+    for (i = 0; i < dev->num_targets; i++) {
+        struct scream_target *t = &dev->targets[i];
+
+        if (i == dev->fo_active)
+            continue;
+        if (t->sock) {
+            int st = READ_ONCE(t->sock->sk->sk_state);
+            bool drop = true;
+
+            if (t->state == SCREAM_TGT_CONNECTING && st == TCP_ESTABLISHED) {
+                set_sock_timeouts(t->sock, 5000);
+                t->state = SCREAM_TGT_READY;
+                t->fails = 0;
+                pr_info(DRIVER_NAME ": card %d: standby %pI4:%u ready\n", dev->index,
+                        &t->addr.sin_addr.s_addr, ntohs(t->addr.sin_port));
+                drop = false;
+            } else if (t->state == SCREAM_TGT_CONNECTING) {
+                drop = (st != TCP_SYN_SENT && st != TCP_SYN_RECV) ||
+                       time_after(jiffies, t->since + msecs_to_jiffies(SCREAM_CONNECT_TIMEOUT_MS));
+            } else if (t->state == SCREAM_TGT_READY) {
+                drop = st != TCP_ESTABLISHED;
+                if (drop)
+                    pr_warn(DRIVER_NAME ": card %d: standby %pI4:%u lost\n", dev->index,
+                            &t->addr.sin_addr.s_addr, ntohs(t->addr.sin_port));
+            }
+            if (drop)
+                scream_target_drop(t);
+        }
+        if (!t->sock && time_after_eq(jiffies, t->since) && scream_target_connect(t) < 0)
+            scream_target_drop(t);
+        ready |= t->state == SCREAM_TGT_READY;
+    }
+    mutex_unlock(&dev->fo_lock);
+
+    if (atomic_read(&dev->closing))
+        return;
+    /* Stream down with a standby at hand: let the reconnect work take it now */
+    if (ready && atomic_read(&dev->connection_state) != STATE_CONNECTED)
+        mod_delayed_work(system_wq, &dev->reconnect_work, 0);
+    schedule_delayed_work(&dev->fo_work, msecs_to_jiffies(clamp(tcp_health_ms, 50, 10000)));
+}
+
+/*
+ * Move the stream onto the first ready standby, in list order. Called by
+ * the tx thread when a send fails, with tx_mutex held, or by the reconnect
+ * work while the stream is down. The socket left behind is marked dead and
+ * released by the health work, which then keeps retrying that receiver as
+ * a standby. False if no standby is ready.
+ */
+static bool scream_failover(struct snd_scream_device *dev, int err)
+{
+    struct scream_target *t = NULL, *old;
+    unsigned int i;
+
+    if (dev->num_targets < 2)
+        return false;
+
+    mutex_lock(&dev->fo_lock);
+    for (i = 0; i < dev->num_targets; i++) {
+        if (i != dev->fo_active && dev->targets[i].state == SCREAM_TGT_READY &&
+            READ_ONCE(dev->targets[i].sock->sk->sk_state) == TCP_ESTABLISHED) {
+            t = &dev->targets[i];
+            break;
+        }
+    }
+    if (!t) {
+        mutex_unlock(&dev->fo_lock);
+        return false;
+    }
+    old = &dev->targets[dev->fo_active];
+    old->sock = dev->sock;
+    old->state = old->sock ? SCREAM_TGT_DEAD : SCREAM_TGT_IDLE;
+    old->since = jiffies;
+    dev->sock = t->sock;
+    t->sock = NULL;
+    t->state = SCREAM_TGT_IDLE;
+    dev->fo_active = i;
+    dev->remote_addr = t->addr;
+    dev->dests[0].addr = t->addr;
+    mutex_unlock(&dev->fo_lock);
+
+    /* A fresh connection: the backlog restarts on a packet boundary */
+    dev->corked = false;
+    dev->fb_len = 0;
+    atomic64_inc(&dev->conn_gen);
+    atomic64_inc(&dev->reconnects);
+    atomic64_inc(&dev->failovers);
+    pr_warn(DRIVER_NAME ": card %d: receiver %pI4:%u failed (%d), switched to %pI4:%u\n",
+            dev->index, &old->addr.sin_addr.s_addr, ntohs(old->addr.sin_port), err,
+            &t->addr.sin_addr.s_addr, ntohs(t->addr.sin_port));
+    return true;
+}
+
+static void scream_release_targets(struct snd_scream_device *dev)
+{
+    unsigned int i;
+
+    cancel_delayed_work_sync(&dev->fo_work);
+    mutex_lock(&dev->fo_lock);
+    for (i = 0; i < dev->num_targets; i++) {
+        if (dev->targets[i].sock)
+            sock_release(dev->targets[i].sock);
+        dev->targets[i].sock = NULL;
+    }
+    dev->num_targets = 0;
+    mutex_unlock(&dev->fo_lock);
+}
+
+static void scream_cleanup_resources(struct snd_scream_device *dev)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&dev->lock, flags);
+    if (dev->is_running) {
+        dev->is_running = false;
+    }
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    scream_tx_detach(dev);
+
+    cancel_delayed_work_sync(&dev->live_work);
+    cancel_delayed_work_sync(&dev->reconnect_work);
+    scream_release_targets(dev);
+    /* Close socket with proper TCP shutdown */
+    if (dev->sock) {
+        if (dev->is_tcp && atomic_read(&dev->connection_state) == STATE_CONNECTED) {
+            dev->sock->ops->shutdown(dev->sock, SHUT_WR);
+        }
+        sock_release(dev->sock);
+        dev->sock = NULL;
+    }
+
+    /* Reset all state atomically */
+    atomic_set(&dev->connection_state, STATE_DISCONNECTED);
+    atomic_set(&dev->reconnect_attempts, 0);
+    spin_lock_irqsave(&dev->lock, flags);
+    dev->is_running = false;
+    dev->substream = NULL;
+    spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+static void scream_set_conn_state(struct snd_scream_device *dev, int state, int err)
+{
+    trace_scream_conn_state(dev->index, atomic_read(&dev->connection_state), state,
+                            atomic_read(&dev->reconnect_attempts), err);
+    atomic_set(&dev->connection_state, state);
+}
+
+static void scream_reconnect_work(struct work_struct *work)
+{
+    struct snd_scream_device *dev = container_of(to_delayed_work(work),
+                                                 struct snd_scream_device,
+                                                 reconnect_work);
+    int ret;
+    if (!dev->is_tcp)
+        return;
+    if (atomic_read(&dev->closing))
+        return;
+
+    pr_info("Called scream_reconnect_work.\n");
+    if (atomic_read(&dev->connection_state) != STATE_CONNECTED && scream_failover(dev, 0)) {
+        scream_set_conn_state(dev, STATE_CONNECTED, 0);
+        atomic_set(&dev->reconnect_attempts, 0);
+        return;
+    }
+    switch (atomic_read(&dev->connection_state)) {
+    case STATE_CONNECTED:
+        /* Nothing to do */
+        return;
+
+    case STATE_CONNECTING:
+        /* Poll non-blocking connect progress without recreating the socket */
+        if (!dev->sock || !dev->sock->sk) {
+            scream_set_conn_state(dev, STATE_DISCONNECTED, 0);
+            if (!atomic_read(&dev->closing))
+                schedule_delayed_work(&dev->reconnect_work, msecs_to_jiffies(200));
+            return;
+        }
+
+        if (dev->sock->sk->sk_state == TCP_ESTABLISHED) {
+            set_sock_timeouts(dev->sock, 5000);
+            scream_set_conn_state(dev, STATE_CONNECTED, 0);
+            atomic_set(&dev->reconnect_attempts, 0);
+            atomic64_inc(&dev->conn_gen);
+            atomic64_inc(&dev->reconnects);
+            pr_info(DRIVER_NAME ": TCP reconnected successfully.\n");
+            return;
         }
         if (dev->sock->sk->sk_state == TCP_SYN_SENT || dev->sock->sk->sk_state == TCP_SYN_RECV) {
             /* Still in progress; poll again soon */
@@ -304,19 +1487,19 @@ static void scream_reconnect_work(struct work_struct *work)
         kernel_sock_shutdown(dev->sock, SHUT_RDWR);
         sock_release(dev->sock);
         dev->sock = NULL;
-        atomic_set(&dev->connection_state, STATE_DISCONNECTED);
+        scream_set_conn_state(dev, STATE_DISCONNECTED, 0);
         /* fallthrough to DISCONNECTED path below */
         /* no break */
     case STATE_DISCONNECTED:
     default: {
         int attempts = atomic_inc_return(&dev->reconnect_attempts);
-        pr_info(DRIVER_NAME ": Reconnecting... (attempt %d)\n", attempts);
 
-        if (attempts > 10) {
-            pr_err(DRIVER_NAME ": Too many reconnect attempts, giving up\n");
-            atomic_set(&dev->reconnect_attempts, 0);
-            return;
-        }
+        /* Keep trying, just less often: the receiver may come back later */
+        if (attempts <= 10)
+            pr_info(DRIVER_NAME ": Reconnecting... (attempt %d)\n", attempts);
+        else if (attempts == 11)
+            pr_warn(DRIVER_NAME ": Receiver still unreachable, retrying every %d ms\n",
+                    SCREAM_RETRY_SLOW_MS);
         /* Close any leftover socket */
         if (dev->sock) {
             pr_info(DRIVER_NAME ": Closing old TCP connection before reconnect\n");
@@ -330,36 +1513,23 @@ static void scream_reconnect_work(struct work_struct *work)
             pr_err(DRIVER_NAME ": Failed to create socket for reconnect: %d\n", ret);
             goto retry_long;
         }
-        /* Set TCP socket options */
-        {
-            int opt = 1;
-            ret = SET_SOCKOPT(dev->sock, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
-            if (ret < 0)
-                pr_warn(DRIVER_NAME ": Failed to set TCP_NODELAY: %d\n", ret);
-
-            ret = SET_SOCKOPT(dev->sock, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
-            if (ret < 0)
-                pr_warn(DRIVER_NAME ": Failed to set SO_KEEPALIVE: %d\n", ret);
-
-            opt = 3000;
-            ret = SET_SOCKOPT(dev->sock, SOL_TCP, TCP_USER_TIMEOUT, &opt, sizeof(opt));
-            if (ret < 0)
-                pr_warn(DRIVER_NAME ": Failed to set TCP_USER_TIMEOUT: %d\n", ret);
-        }
+        scream_tcp_sockopts(dev->sock);
         /* Start non-blocking connect and keep socket for polling */
         ret = kernel_connect(dev->sock, (struct sockaddr *)&dev->remote_addr,
                              sizeof(dev->remote_addr), O_NONBLOCK);
         if (ret == 0) {
             /* Connected immediately */
             set_sock_timeouts(dev->sock, 5000);
-            atomic_set(&dev->connection_state, STATE_CONNECTED);
+            scream_set_conn_state(dev, STATE_CONNECTED, 0);
             atomic_set(&dev->reconnect_attempts, 0);
+            atomic64_inc(&dev->conn_gen);
+            atomic64_inc(&dev->reconnects);
             pr_info(DRIVER_NAME ": TCP reconnected successfully.\n");
             return;
         } else if (ret == -EINPROGRESS) {
             /* Connection in progress, keep state and poll soon */
             pr_debug(DRIVER_NAME ": TCP connect started (non-blocking).\n");
-            atomic_set(&dev->connection_state, STATE_CONNECTING);
+            scream_set_conn_state(dev, STATE_CONNECTING, 0);
             if (!atomic_read(&dev->closing))
                 schedule_delayed_work(&dev->reconnect_work, msecs_to_jiffies(200));
             return;
@@ -372,9 +1542,11 @@ static void scream_reconnect_work(struct work_struct *work)
       }
     }
 retry_long:
-    atomic_set(&dev->connection_state, STATE_DISCONNECTED);
+    scream_set_conn_state(dev, STATE_DISCONNECTED, ret);
     if (!atomic_read(&dev->closing))
-        schedule_delayed_work(&dev->reconnect_work, msecs_to_jiffies(2000));
+        schedule_delayed_work(&dev->reconnect_work,
+                              msecs_to_jiffies(atomic_read(&dev->reconnect_attempts) > 10 ?
+                                               SCREAM_RETRY_SLOW_MS : 2000));
 }
 
 static unsigned int scream_reconnect_delay_ms_for_err(int err)
@@ -396,442 +1568,2699 @@ static unsigned int scream_reconnect_delay_ms_for_err(int err)
     }
 }
 
-static u8 lastbuf[SCREAM_HEADER_SIZE + SCREAM_PAYLOAD_SIZE] = {0};
-static int scream_send_last_packet(struct snd_scream_device *dev)
+/* Per-packet part of the extended header; frames is the audio it carries */
+static void scream_stamp_header(struct snd_scream_device *dev, u8 *hdr, s64 now_ns, unsigned int frames)
 {
-    struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
-    struct kvec iov;
-    int ret = 0;
-
-    memcpy(lastbuf, dev->network_buffer, SCREAM_HEADER_SIZE);
-    lastbuf[4] = 0x80;
+    if (!dev->ext_on)
+        return;
+    scream_ext_put(hdr, dev->tx_seq++, dev->tx_frames, now_ns);
+    dev->tx_frames += frames;
+}
 
-    iov.iov_base = lastbuf;
+/* True if the payload after the header is all silence. Runs right after
+ * the copy (or on the ring, for zero-copy) and stops at the first
+ * non-silent word, so real audio costs next to nothing. */
+static bool scream_payload_silent(struct snd_scream_device *dev, const struct kvec *iov, unsigned int nvec)
+{
+    int fill = dev->is_dsd ? SCREAM_DSD_IDLE : 0;
+    size_t skip = dev->hdr_size;
+    unsigned int i;
 
-    if (dev->is_tcp) {
-        if (atomic_read(&dev->connection_state) != STATE_CONNECTED)
-            return -ENOTCONN;
-        iov.iov_len = SCREAM_PACKET_SIZE;
-        ret = kernel_sendmsg(dev->sock, &msg, &iov, 1, SCREAM_PACKET_SIZE);
-    } else {
-        iov.iov_len = SCREAM_HEADER_SIZE;
-        msg.msg_name = &dev->remote_addr;
-        msg.msg_namelen = sizeof(dev->remote_addr);
-        ret = kernel_sendmsg(dev->sock, &msg, &iov, 1, SCREAM_HEADER_SIZE);
+    for (i = 0; i < nvec; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        if (memchr_inv((u8 *)iov[i].iov_base + skip, fill, iov[i].iov_len - skip))
+            return false;
+        skip = 0;
     }
-    return ret;
+    return true;
 }
 
-static void scream_build_payload_locked(struct snd_scream_device *dev,
-                                        struct snd_pcm_runtime *runtime,
-                                        size_t current_hw_ptr,
-                                        void *data)
+/* ------------------------------
+ *      LZ4 payload compression
+ * ------------------------------ */
+#ifdef SCREAM_HAVE_LZ4
+static void scream_lz4_alloc(struct snd_scream_device *dev)
 {
-    size_t buffer_size =runtime->buffer_size*4*dev->channels;
-    if (current_hw_ptr + SCREAM_PAYLOAD_SIZE > buffer_size) {
-        size_t len1 = buffer_size - current_hw_ptr;
-        size_t len2 = SCREAM_PAYLOAD_SIZE - len1;
-        memcpy(data, runtime->dma_area + current_hw_ptr, len1);
-        memcpy(data + len1, runtime->dma_area, len2);
-    } else {
-        memcpy(data, runtime->dma_area + current_hw_ptr, SCREAM_PAYLOAD_SIZE);
+    if (dev->lz4_buf)
+        return;
+    dev->lz4_buf = vmalloc(SCREAM_MAX_BATCH * SCREAM_LZ4_STRIDE + SCREAM_MAX_PAYLOAD);
+    dev->lz4_wrk = vmalloc(LZ4_MEM_COMPRESS);
+    if (!dev->lz4_buf || !dev->lz4_wrk) {
+        pr_warn(DRIVER_NAME ": card %d: no memory for LZ4, sending uncompressed\n", dev->index);
+        vfree(dev->lz4_buf);
+        vfree(dev->lz4_wrk);
+        dev->lz4_buf = NULL;
+        dev->lz4_wrk = NULL;
     }
-    if(dev->is_dsd)
-        convert_data(data, SCREAM_PAYLOAD_SIZE/8);
 }
 
-static int scream_playback_thread(void *data)
+/* Compressed size, or 0 if it would not fit in max bytes */
+static size_t scream_lz4(struct snd_scream_device *dev, const u8 *src, size_t len, u8 *dst, size_t max)
 {
-    struct snd_scream_device *dev = data;
-    struct snd_pcm_substream *sub;
-    struct snd_pcm_runtime *rt;
-    ktime_t next_wake;
-    bool is_first_packet;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+    int ret = LZ4_compress_default((const char *)src, (char *)dst, len, max, dev->lz4_wrk);
 
-    /* Set realtime priority SCHED_FIFO 50 */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
-    sched_set_fifo(current);
+    return ret > 0 ? ret : 0;
 #else
-    struct sched_param param = { .sched_priority = 50 };
-    sched_setscheduler(current, SCHED_FIFO, &param);
-#endif
+    size_t out;
 
-    while (!kthread_should_stop()) {
-        wait_event_interruptible(dev->playback_waitq, kthread_should_stop() || dev->is_running);
-        
-        if (kthread_should_stop())
-            break;
+    /* dst has room for the worst case, see SCREAM_LZ4_STRIDE */
+    if (lz4_compress(src, len, dst, &out, dev->lz4_wrk) || out > max)
+        return 0;
+    return out;
+#endif
+}
 
-        is_first_packet = true;
-        next_wake = ktime_get();
+/* Compress one built packet into slot n of lz4_buf. Returns the length of
+ * the compressed packet, or 0 to send the original. A payload that does not
+ * shrink by lz4_min_saving makes the next attempts wait, doubling up to
+ * SCREAM_LZ4_BACKOFF_MAX packets, so incompressible streams cost little. */
+static size_t scream_lz4_packet(struct snd_scream_device *dev, const struct kvec *iov,
+                                unsigned int nvec, unsigned int n)
+{
+    u8 *pkt = dev->lz4_buf + n * SCREAM_LZ4_STRIDE;
+    u8 *gather = dev->lz4_buf + SCREAM_MAX_BATCH * SCREAM_LZ4_STRIDE;
+    size_t len = dev->payload_size, max, out;
+    const u8 *src;
+    ktime_t t0;
 
-        while (!kthread_should_stop()) {
-            unsigned long flags;
-            snd_pcm_sframes_t avail_fr;
-            bool do_send = false;
+    if (dev->lz4_skip) {
+        dev->lz4_skip--;
+        return 0;
+    }
+    /* Copied packets are one kvec; zero-copy ones are header + one or two ring segments */
+    if (nvec == 1) {
+        src = (const u8 *)iov[0].iov_base + dev->hdr_size;
+    } else if (nvec == 2) {
+        src = iov[1].iov_base;
+    } else {
+        memcpy(gather, iov[1].iov_base, iov[1].iov_len);
+        memcpy(gather + iov[1].iov_len, iov[2].iov_base, iov[2].iov_len);
+        src = gather;
+    }
+    max = len - len * clamp(lz4_min_saving, 0, 90) / 100;
+    if (max <= SCREAM_LZ4_LEN_SIZE)
+        return 0;
 
-            spin_lock_irqsave(&dev->lock, flags);
-        if (!dev->is_running) {
-            spin_unlock_irqrestore(&dev->lock, flags);
-            break;
-        }
+    t0 = ktime_get();
+    out = scream_lz4(dev, src, len, pkt + dev->hdr_size + SCREAM_LZ4_LEN_SIZE, max - SCREAM_LZ4_LEN_SIZE);
+    dev->stats.lz4_ns += ktime_to_ns(ktime_sub(ktime_get(), t0));
+    dev->stats.lz4_tries++;
+    if (!out) {
+        dev->lz4_backoff = clamp_t(unsigned int, dev->lz4_backoff * 2, 1, SCREAM_LZ4_BACKOFF_MAX);
+        dev->lz4_skip = dev->lz4_backoff;
+        return 0;
+    }
+    dev->lz4_backoff = 0;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
-        sub = READ_ONCE(dev->substream);
+    memcpy(pkt, iov[0].iov_base, dev->hdr_size);
+    pkt[4] |= SCREAM_FLAG_LZ4;
+    pkt[dev->hdr_size] = len;
+    pkt[dev->hdr_size + 1] = len >> 8;
+    dev->stats.lz4_packets++;
+    dev->stats.lz4_in += len;
+    dev->stats.lz4_out += SCREAM_LZ4_LEN_SIZE + out;
+    return dev->hdr_size + SCREAM_LZ4_LEN_SIZE + out;
+}
 #else
-        sub = dev->substream;
+static void scream_lz4_alloc(struct snd_scream_device *dev)
+{
+    pr_warn_once(DRIVER_NAME ": lz4 needs a kernel with CONFIG_LZ4_COMPRESS\n");
+}
+
+static size_t scream_lz4_packet(struct snd_scream_device *dev, const struct kvec *iov,
+                                unsigned int nvec, unsigned int n)
+{
+    return 0;
+}
 #endif
-        if (!sub) {
-            spin_unlock_irqrestore(&dev->lock, flags);
-            usleep_range(1000, 2000);
-            continue;
-        }
 
-        rt = sub->runtime;
-        avail_fr = snd_pcm_playback_hw_avail(rt);
-        if (avail_fr < 0) avail_fr = 0;
+/* Last pass over a built batch, for UDP: with silence_suppress, fold each
+ * run of silent packets into one marker written over the first one's
+ * payload; with lz4, swap in compressed copies of packets that
+ * shrink. Stamps the headers on the way. Returns the number of packets
+ * left to send. */
+static unsigned int scream_finish_batch(struct snd_scream_device *dev, unsigned int npkts,
+                                        s64 now_ns, unsigned int pkt_frames)
+{
+    struct kvec *in = dev->tx_iov, *out = dev->tx_iov;
+    u8 flags = dev->ext_on ? SCREAM_FLAG_EXT : 0;
+    bool fold = silence_suppress && !dev->is_tcp;
+    bool pack = lz4 && !dev->is_tcp && dev->lz4_buf;
+    unsigned int i, n, run, nvec;
+    bool silent;
+    size_t len;
+    u8 *hdr;
 
-        if (avail_fr * 4 * dev->channels >= SCREAM_PAYLOAD_SIZE) {
-            size_t buf_bytes = rt->buffer_size * 4 * dev->channels;
-            
-            scream_build_payload_locked(dev, rt, dev->hw_ptr,
-                                        dev->network_buffer + SCREAM_HEADER_SIZE);
-            dev->hw_ptr = (dev->hw_ptr + SCREAM_PAYLOAD_SIZE) % buf_bytes;
-            
-            do_send = true;
+    dev->tx_short = 0;
+    for (i = 0, n = 0; i < npkts; i += run, n++) {
+        nvec = dev->tx_nvec[i];
+        hdr = in->iov_base;
+        run = 1;
+        silent = fold && scream_payload_silent(dev, in, nvec);
+        if (silent) {
+            in += nvec;
+            while (i + run < npkts && scream_payload_silent(dev, in, dev->tx_nvec[i + run]))
+                in += dev->tx_nvec[i + run++];
+        }
+        hdr[4] = flags | (silent ? SCREAM_FLAG_SILENCE : 0);
+        scream_stamp_header(dev, hdr, now_ns, run * pkt_frames);
+        if (silent) {
+            scream_silence_put(hdr + dev->hdr_size, run * pkt_frames);
+            out->iov_base = hdr;
+            out->iov_len = dev->hdr_size + SCREAM_SILENCE_SIZE;
+            dev->tx_nvec[n] = 1;
+            dev->tx_short |= 1u << n;
+            dev->stats.silence_pkts += run;
+            dev->stats.silence_bytes += (size_t)run * dev->packet_size - out->iov_len;
+            out++;
+            continue;
         }
-        spin_unlock_irqrestore(&dev->lock, flags);
-
-        if (do_send) {
-            if (!dev->is_tcp || atomic_read(&dev->connection_state) == STATE_CONNECTED) {
-                struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
-                struct kvec iov = { .iov_base = dev->network_buffer, .iov_len = SCREAM_PACKET_SIZE };
-                int ret;
-                if (!dev->is_tcp) {
-                    msg.msg_name = &dev->remote_addr;
-                    msg.msg_namelen = sizeof(dev->remote_addr);
-                }
-                ret = kernel_sendmsg(dev->sock, &msg, &iov, 1, SCREAM_PACKET_SIZE);
-                if (ret < 0 && dev->is_tcp) {
-                    if (ret != -EAGAIN && ret != -ENOBUFS) {
-                        unsigned int delay = scream_reconnect_delay_ms_for_err(ret);
-                        if (atomic_cmpxchg(&dev->connection_state, STATE_CONNECTED, STATE_DISCONNECTED) == STATE_CONNECTED) {
-                            if (!atomic_read(&dev->closing))
-                                schedule_delayed_work(&dev->reconnect_work, msecs_to_jiffies(delay));
-                        }
-                    }
-                } else if (dev->is_tcp && ret != SCREAM_PACKET_SIZE) {
-                    /* Force reconnect on partial send to prevent receiver desync */
-                    if (atomic_cmpxchg(&dev->connection_state, STATE_CONNECTED, STATE_DISCONNECTED) == STATE_CONNECTED) {
-                        if (!atomic_read(&dev->closing))
-                            schedule_delayed_work(&dev->reconnect_work, msecs_to_jiffies(100));
-                    }
-                }
-            }
-            
-            /* Handle ALSA period elapsed natively */
-            dev->bytes_in_period += SCREAM_PAYLOAD_SIZE;
-            if (dev->bytes_in_period >= dev->alsa_period_bytes) {
-                dev->bytes_in_period -= dev->alsa_period_bytes;
-                snd_pcm_period_elapsed(sub);
-            }
-
-            /* Wait precisely for the next packet interval */
-            if (is_first_packet) {
-                next_wake = ktime_get();
-                is_first_packet = false;
-            } else {
-                next_wake = ktime_add(next_wake, dev->period_time_ns);
-                
-                /* Catch up if we are severely behind */
-                if (ktime_compare(ktime_get(), next_wake) > 0) {
-                     next_wake = ktime_get();
-                } else {
-                     set_current_state(TASK_INTERRUPTIBLE);
-                     schedule_hrtimeout(&next_wake, HRTIMER_MODE_ABS);
-                }
-            }
 
+        len = pack ? scream_lz4_packet(dev, in, nvec, n) : 0;
+        if (len) {
+            out->iov_base = dev->lz4_buf + n * SCREAM_LZ4_STRIDE;
+            out->iov_len = len;
+            dev->tx_nvec[n] = 1;
+            dev->tx_short |= 1u << n;
+            out++;
         } else {
-            /* No data available, sleep lightly to avoid CPU burn */
-            usleep_range(200, 500);
-            next_wake = ktime_get(); /* reset timeline after underrun */
+            if (out != in)
+                memmove(out, in, nvec * sizeof(*in));
+            dev->tx_nvec[n] = nvec;
+            out += nvec;
         }
+        in += nvec;
     }
+    return n;
+}
+
+static void scream_build_payload(struct snd_scream_device *dev,
+                                 struct snd_pcm_runtime *runtime,
+                                 size_t current_hw_ptr,
+                                 void *data)
+{
+    size_t buffer_size = frames_to_bytes(runtime, runtime->buffer_size);
+    size_t src_len = dev->src_payload_size;
+    if (current_hw_ptr + src_len > buffer_size) {
+        size_t len1 = buffer_size - current_hw_ptr;
+        size_t len2 = src_len - len1;
+        size_t out = scream_copy_samples(dev, data, runtime->dma_area + current_hw_ptr, len1);
+        scream_copy_samples(dev, (u8 *)data + out, runtime->dma_area, len2);
+    } else {
+        scream_copy_samples(dev, data, runtime->dma_area + current_hw_ptr, src_len);
     }
-    return 0;
 }
 
-static int snd_scream_pcm_open(struct snd_pcm_substream *substream)
+/* Zero-copy variant: point the packet's kvecs at the header template and at
+ * the one or two ring segments holding the payload. */
+static unsigned int scream_map_payload(struct snd_scream_device *dev,
+                                       struct snd_pcm_runtime *runtime,
+                                       size_t current_hw_ptr,
+                                       u8 *hdr, struct kvec *iov)
 {
-    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
-    struct snd_pcm_runtime *runtime = substream->runtime;
-    int ret;
+    size_t buffer_size = frames_to_bytes(runtime, runtime->buffer_size);
+    size_t payload = dev->payload_size;
 
-    atomic_set(&dev->closing, 0);
-    dev->substream = substream;
-    runtime->hw = snd_scream_hw;
-    ret = snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
-    if (ret < 0)
-        return ret;
-    dev->is_tcp = sysfs_streq(protocol_str, "tcp");
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = dev->hdr_size;
+    if (current_hw_ptr + payload > buffer_size) {
+        size_t len1 = buffer_size - current_hw_ptr;
+        iov[1].iov_base = runtime->dma_area + current_hw_ptr;
+        iov[1].iov_len = len1;
+        iov[2].iov_base = runtime->dma_area;
+        iov[2].iov_len = payload - len1;
+        return 3;
+    }
+    iov[1].iov_base = runtime->dma_area + current_hw_ptr;
+    iov[1].iov_len = payload;
+    return 2;
+}
 
-    /* Reuse existing socket for seamless track switching */
-    if (dev->sock) {
-        if (dev->is_tcp &&
+static int scream_sendmsg(struct snd_scream_device *dev, int dest, struct msghdr *msg,
+                          struct kvec *iov, size_t nvec, size_t len)
+{
+    s64 t0 = scream_trace_on(scream_send) ? ktime_to_ns(ktime_get()) : 0;
+    int ret = kernel_sendmsg(dev->sock, msg, iov, nvec, len);
+
+    if (scream_trace_on(scream_send))
+        trace_scream_send(dev->index, dest, ret, len, ktime_to_ns(ktime_get()) - t0);
+    return ret;
+}
+
+/* ------------------------------
+ *      TCP corking and page sends
+ * ------------------------------ */
+/* MSG_MORE while the next batch is due inside the cork budget, so several
+ * batches share a segment; the batch that would overrun the budget pushes. */
+static int scream_tcp_more(struct snd_scream_device *dev, unsigned int npkts)
+{
+    ktime_t now;
+    s64 next_ns;
+
+    if (tcp_cork_us <= 0 || !dev->byte_rate)
+        return 0;
+    now = ktime_get();
+    if (!dev->corked)
+        dev->cork_start = now;
+    next_ns = ktime_to_ns(ktime_sub(now, dev->cork_start)) +
+              div64_u64((u64)npkts * dev->src_payload_size * NSEC_PER_SEC, dev->byte_rate);
+    dev->corked = next_ns < (s64)tcp_cork_us * NSEC_PER_USEC;
+    return dev->corked ? MSG_MORE : 0;
+}
+
+/* Push out whatever MSG_MORE held back; setting TCP_NODELAY again flushes */
+static void scream_tcp_flush(struct snd_scream_device *dev)
+{
+    int opt = 1;
+
+    dev->corked = false;
+    if (dev->sock && atomic_read(&dev->connection_state) == STATE_CONNECTED)
+        SET_PROTO_SOCKOPT(dev->sock, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+}
+
+/* Buffers still referenced by queued skbs are freed by the last put_page */
+static void scream_zc_pool_free(struct snd_scream_device *dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < SCREAM_ZC_SLOTS; i++) {
+        if (dev->zc_pool[i])
+            put_page(dev->zc_pool[i]);
+        dev->zc_pool[i] = NULL;
+    }
+}
+
+/* Size the pool for one batch of the current stream, with room for the
+ * extended header should a receiver ask for it mid-stream. The pool only
+ * grows; a short batch of small packets stays at order 0. Called with no
+ * batch in flight: from hw_params, or under tx_mutex. */
+static void scream_zc_pool_fit(struct snd_scream_device *dev)
+{
+    unsigned int order, i;
+
+    if (!dev->is_tcp || !tcp_zerocopy)
+        return;
+    order = get_order(dev->tx_batch * (SCREAM_EXT_HEADER_SIZE + dev->payload_size));
+    if (dev->zc_pool[0] && dev->zc_order >= order)
+        return;
+    scream_zc_pool_free(dev);
+    for (i = 0; i < SCREAM_ZC_SLOTS; i++) {
+        dev->zc_pool[i] = alloc_pages(GFP_KERNEL | __GFP_COMP | __GFP_NOWARN, order);
+        if (!dev->zc_pool[i])
+            break;
+    }
+    if (i < SCREAM_ZC_SLOTS) {
+        pr_warn(DRIVER_NAME ": card %d: no memory for the TCP page pool (order %u), copying instead\n",
+                dev->index, order);
+        while (i--) {
+            put_page(dev->zc_pool[i]);
+            dev->zc_pool[i] = NULL;
+        }
+    }
+    dev->zc_order = order;
+    dev->zc_next = 0;
+}
+
+/* Next pool buffer the stack has let go of, or NULL to copy this batch.
+ * TCP releases data in order, so the buffers come back round-robin. */
+static struct page *scream_zc_take(struct snd_scream_device *dev)
+{
+    struct page *page = dev->zc_pool[dev->zc_next];
+
+    if (!dev->is_tcp || !page)
+        return NULL;
+    if (page_count(page) != 1) {
+        dev->stats.tcp_pool_busy++;
+        return NULL;
+    }
+    dev->zc_next = (dev->zc_next + 1) % SCREAM_ZC_SLOTS;
+    return page;
+}
+
+/* Queue len bytes of a pool buffer on the TCP socket by reference */
+static int scream_sendpage(struct snd_scream_device *dev, struct page *page, size_t len, int more)
+{
+    s64 t0 = scream_trace_on(scream_send) ? ktime_to_ns(ktime_get()) : 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL | MSG_SPLICE_PAGES | more };
+    struct bio_vec bv;
+    int ret;
+
+    bvec_set_page(&bv, page, len, 0);
+    iov_iter_bvec(&msg.msg_iter, ITER_SOURCE, &bv, 1, len);
+    ret = sock_sendmsg(dev->sock, &msg);
+#else
+    size_t off = 0;
+    int ret = 0;
+
+    /* sendpage takes one page at a time */
+    while (off < len) {
+        size_t chunk = min_t(size_t, PAGE_SIZE - off % PAGE_SIZE, len - off);
+
+        ret = kernel_sendpage(dev->sock, nth_page(page, off / PAGE_SIZE), off % PAGE_SIZE, chunk,
+                              MSG_DONTWAIT | MSG_NOSIGNAL | (off + chunk < len ? MSG_MORE : more));
+        if (ret <= 0)
+            break;
+        off += ret;
+        if ((size_t)ret < chunk)
+            break;
+    }
+    if (off)
+        ret = off;
+#endif
+    if (scream_trace_on(scream_send))
+        trace_scream_send(dev->index, -1, ret, len, ktime_to_ns(ktime_get()) - t0);
+    if (ret > 0)
+        dev->stats.tcp_page_sends++;
+    return ret;
+}
+
+/* Drop the connection after a hard send error; the receiver has lost framing */
+static void scream_tcp_fail(struct snd_scream_device *dev, int err, unsigned int delay_ms)
+{
+    if (atomic_read(&dev->connection_state) == STATE_CONNECTED && scream_failover(dev, err))
+        return;
+    if (atomic_cmpxchg(&dev->connection_state, STATE_CONNECTED, STATE_DISCONNECTED) == STATE_CONNECTED) {
+        trace_scream_conn_state(dev->index, STATE_CONNECTED, STATE_DISCONNECTED,
+                                atomic_read(&dev->reconnect_attempts), err);
+        if (!atomic_read(&dev->closing))
+            schedule_delayed_work(&dev->reconnect_work, msecs_to_jiffies(delay_ms));
+    }
+}
+
+/* ------------------------------
+ *      TCP backlog
+ * ------------------------------ */
+/* Bytes the socket would not take are kept here, in order, and retried
+ * before anything new. The ring tracks packet boundaries so overflow can
+ * drop whole packets without breaking the receiver's framing. */
+static bool scream_backlog_on(struct snd_scream_device *dev)
+{
+    return dev->is_tcp && dev->bl_buf && tcp_backlog_ms > 0;
+}
+
+static bool scream_backlog_stalls(void)
+{
+    return sysfs_streq(tcp_backlog_policy, "stall");
+}
+
+/* tcp_backlog_ms of wire bytes, never less than a batch plus a packet */
+static size_t scream_backlog_limit(struct snd_scream_device *dev)
+{
+    u64 wire_rate = div_u64(dev->byte_rate * dev->packet_size, dev->src_payload_size);
+    u64 limit = div_u64(wire_rate * (u64)max(tcp_backlog_ms, 0), 1000);
+
+    limit = max_t(u64, limit, (u64)(dev->tx_batch + 1) * dev->packet_size);
+    return min_t(u64, limit, SCREAM_BACKLOG_BYTES);
+}
+
+static size_t scream_backlog_room(struct snd_scream_device *dev)
+{
+    return dev->bl_limit > dev->bl_len ? dev->bl_limit - dev->bl_len : 0;
+}
+
+static void scream_backlog_reset(struct snd_scream_device *dev)
+{
+    dev->bl_head = 0;
+    dev->bl_len = 0;
+    dev->bl_rem = 0;
+}
+
+static void scream_backlog_write(struct snd_scream_device *dev, size_t at, const u8 *src, size_t len)
+{
+    size_t first = min(len, SCREAM_BACKLOG_BYTES - at);
+
+    memcpy(dev->bl_buf + at, src, first);
+    memcpy(dev->bl_buf, src + first, len - first);
+}
+
+/* Drop the oldest whole packets until need bytes are free. A partly sent
+ * packet at the head has to go out complete, so it is moved up past the
+ * dropped ones. */
+static void scream_backlog_drop(struct snd_scream_device *dev, size_t need)
+{
+    size_t whole = (dev->bl_len - dev->bl_rem) / dev->bl_pkt;
+    size_t k = min_t(size_t, whole, DIV_ROUND_UP(need, dev->bl_pkt));
+    size_t skip = k * dev->bl_pkt, j;
+
+    if (!k)
+        return;
+    for (j = dev->bl_rem; j-- > 0; )
+        dev->bl_buf[(dev->bl_head + skip + j) % SCREAM_BACKLOG_BYTES] =
+            dev->bl_buf[(dev->bl_head + j) % SCREAM_BACKLOG_BYTES];
+    dev->bl_head = (dev->bl_head + skip) % SCREAM_BACKLOG_BYTES;
+    dev->bl_len -= skip;
+    dev->stats.bl_dropped += k;
+    dev->stats.drops += k;
+}
+
+/* Queue what is left of a batch after the socket took the first sent bytes */
+static void scream_backlog_queue(struct snd_scream_device *dev, const struct kvec *iov,
+                                 unsigned int nvec, size_t total, size_t sent)
+{
+    size_t len = total - sent, at, skip = sent;
+    unsigned int i;
+
+    if (dev->bl_len == 0) {
+        dev->bl_conn = atomic64_read(&dev->conn_gen);
+        dev->bl_rem = sent % dev->packet_size ? dev->packet_size - sent % dev->packet_size : 0;
+    } else if (dev->bl_pkt != dev->packet_size) {
+        /* Stream changed format behind a stall: the old packets are stale */
+        scream_backlog_drop(dev, dev->bl_len);
+    }
+    dev->bl_pkt = dev->packet_size;
+    if (len > scream_backlog_room(dev))
+        scream_backlog_drop(dev, len - scream_backlog_room(dev));
+
+    at = (dev->bl_head + dev->bl_len) % SCREAM_BACKLOG_BYTES;
+    for (i = 0; i < nvec; i++) {
+        size_t n;
+
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        n = iov[i].iov_len - skip;
+        scream_backlog_write(dev, at, (const u8 *)iov[i].iov_base + skip, n);
+        at = (at + n) % SCREAM_BACKLOG_BYTES;
+        skip = 0;
+    }
+    dev->bl_len += len;
+    dev->stats.bl_queued += DIV_ROUND_UP(len, dev->packet_size);
+    dev->stats.bl_max = max_t(u64, dev->stats.bl_max, dev->bl_len);
+}
+
+/* Retry the backlog; true once it is empty */
+static bool scream_backlog_flush(struct snd_scream_device *dev)
+{
+    s64 conn = atomic64_read(&dev->conn_gen);
+
+    if (dev->bl_conn != conn) {
+        /* A new connection starts on a packet boundary */
+        scream_backlog_reset(dev);
+        dev->bl_conn = conn;
+    }
+    while (dev->bl_len) {
+        struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
+        size_t first = min(dev->bl_len, SCREAM_BACKLOG_BYTES - dev->bl_head);
+        struct kvec iov[2] = {
+            { .iov_base = dev->bl_buf + dev->bl_head, .iov_len = first },
+            { .iov_base = dev->bl_buf, .iov_len = dev->bl_len - first },
+        };
+        size_t done;
+        int ret;
+
+        if (atomic_read(&dev->connection_state) != STATE_CONNECTED)
+            return false;
+        ret = scream_sendmsg(dev, -1, &msg, iov, iov[1].iov_len ? 2 : 1, dev->bl_len);
+        if (ret <= 0) {
+            if (ret < 0 && ret != -EAGAIN && ret != -ENOBUFS) {
+                dev->dests[0].last_err = ret;
+                atomic64_inc(&dev->dests[0].errors);
+                scream_tcp_fail(dev, ret, scream_reconnect_delay_ms_for_err(ret));
+            }
+            return false;
+        }
+
+        /* Packets completed by these bytes */
+        if ((size_t)ret >= dev->bl_rem) {
+            size_t x = ret - dev->bl_rem;
+
+            done = (dev->bl_rem ? 1 : 0) + x / dev->bl_pkt;
+            dev->bl_rem = x % dev->bl_pkt ? dev->bl_pkt - x % dev->bl_pkt : 0;
+        } else {
+            done = 0;
+            dev->bl_rem -= ret;
+        }
+        dev->bl_head = (dev->bl_head + ret) % SCREAM_BACKLOG_BYTES;
+        dev->bl_len -= ret;
+        dev->stats.bytes += ret;
+        dev->stats.packets += done;
+        atomic64_add(done, &dev->dests[0].packets);
+    }
+    dev->bl_rem = 0;
+    return true;
+}
+
+static int scream_send_last_packet(struct snd_scream_device *dev)
+{
+    struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
+    struct kvec iov;
+    u8 *lastbuf = dev->last_buffer;
+    int ret = 0;
+
+    memcpy(lastbuf, dev->network_buffer, dev->hdr_size);
+    lastbuf[4] |= SCREAM_FLAG_END;
+    scream_stamp_header(dev, lastbuf, ktime_to_ns(ktime_get()), 0);
+
+    iov.iov_base = lastbuf;
+
+    if (dev->is_tcp) {
+        if (atomic_read(&dev->connection_state) != STATE_CONNECTED)
+            return -ENOTCONN;
+        iov.iov_len = dev->packet_size;
+        /* Behind a backlog the marker queues like any other packet */
+        if (scream_backlog_on(dev) && dev->bl_len && !scream_backlog_flush(dev)) {
+            scream_backlog_queue(dev, &iov, 1, dev->packet_size, 0);
+            return 0;
+        }
+        ret = kernel_sendmsg(dev->sock, &msg, &iov, 1, dev->packet_size);
+    } else {
+        unsigned int d;
+
+        iov.iov_len = dev->hdr_size;
+        for (d = 0; d < dev->num_dests; d++) {
+            msg.msg_name = &dev->dests[d].addr;
+            msg.msg_namelen = sizeof(dev->dests[d].addr);
+            ret = kernel_sendmsg(dev->sock, &msg, &iov, 1, dev->hdr_size);
+        }
+    }
+    return ret;
+}
+
+/* ------------------------------
+ *      Forward error correction
+ * ------------------------------ */
+/* Parity j goes to every receiver on its parity port, see scream_fec.h */
+static void scream_fec_send(struct snd_scream_device *dev)
+{
+    size_t len = SCREAM_FEC_HDR_SIZE + 4 * dev->fec_n + dev->payload_size;
+    unsigned int i, j, d;
+
+    for (j = 0; j < dev->fec_k; j++) {
+        u8 *pkt = dev->fec_buf + j * SCREAM_FEC_PKT_MAX;
+        struct kvec iov = { .iov_base = pkt, .iov_len = len };
+
+        scream_fec_put_header(pkt, dev->fec_n, dev->fec_k, j, dev->fec_seq, dev->payload_size);
+        for (i = 0; i < dev->fec_n; i++)
+            scream_fec_put32(pkt + SCREAM_FEC_HDR_SIZE + 4 * i, dev->fec_hash[i]);
+
+        for (d = 0; d < dev->num_dests; d++) {
+            struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
+            struct sockaddr_in addr = dev->dests[d].addr;
+
+            addr.sin_port = htons(scream_fec_port(dev->index, ntohs(addr.sin_port)));
+            msg.msg_name = &addr;
+            msg.msg_namelen = sizeof(addr);
+            if (scream_sendmsg(dev, d, &msg, &iov, 1, len) > 0)
+                dev->stats.fec_sent++;
+        }
+    }
+}
+
+/* Fold one data packet into the current group and send the parities once
+ * it is complete */
+static void scream_fec_add(struct snd_scream_device *dev, const struct kvec *iov, unsigned int nvec)
+{
+    unsigned int slot = dev->fec_fill % dev->fec_k, i;
+    u8 *par = dev->fec_buf + slot * SCREAM_FEC_PKT_MAX + SCREAM_FEC_HDR_SIZE + 4 * dev->fec_n;
+    bool first = dev->fec_fill < dev->fec_k;
+    u32 h = SCREAM_FEC_HASH_INIT;
+    size_t off = 0;
+
+    for (i = 0; i < nvec; i++) {
+        const u8 *p = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        h = scream_fec_hash(h, p, len);
+        if (off + len > dev->hdr_size) {
+            size_t skip = off < dev->hdr_size ? dev->hdr_size - off : 0;
+            u8 *dst = par + off + skip - dev->hdr_size;
+
+            if (first)
+                memcpy(dst, p + skip, len - skip);
+            else
+                scream_fec_xor(dst, p + skip, len - skip);
+        }
+        off += len;
+    }
+    dev->fec_hash[dev->fec_fill++] = h;
+
+    if (dev->fec_fill == dev->fec_n) {
+        scream_fec_send(dev);
+        dev->fec_fill = 0;
+        dev->fec_seq++;
+    }
+}
+
+/* One datagram to one receiver; errors stay on that receiver's counters */
+static void scream_send_udp(struct snd_scream_device *dev, unsigned int d,
+                            struct kvec *iov, unsigned int nvec, size_t len)
+{
+    struct scream_dest *dst = &dev->dests[d];
+    struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
+    int ret;
+
+    msg.msg_name = &dst->addr;
+    msg.msg_namelen = sizeof(dst->addr);
+    ret = scream_sendmsg(dev, d, &msg, iov, nvec, len);
+    if (ret < 0) {
+        atomic64_inc(&dst->errors);
+        dst->last_err = ret;
+        if (ret == -EAGAIN || ret == -ENOBUFS)
+            dev->stats.drops++;
+    } else {
+        atomic64_inc(&dst->packets);
+        dev->stats.packets++;
+        dev->stats.bytes += ret;
+    }
+}
+
+#ifdef SCREAM_HAVE_UDP_GSO
+/* Send npkts consecutive packets to one receiver as a single UDP_SEGMENT
+ * send; the stack or the NIC splits it back into packet_size datagrams, so
+ * the wire format is unchanged. Returns false if the route refused it and
+ * the packets still have to go out one by one. */
+static bool scream_send_gso(struct snd_scream_device *dev, unsigned int d,
+                            struct kvec *iov, unsigned int nvec, unsigned int npkts)
+{
+    struct scream_dest *dst = &dev->dests[d];
+    struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
+    union {
+        struct cmsghdr hdr;
+        u8 buf[CMSG_SPACE(sizeof(u16))];
+    } ctl;
+    size_t len = (size_t)npkts * dev->packet_size;
+    int ret;
+
+    ctl.hdr.cmsg_level = SOL_UDP;
+    ctl.hdr.cmsg_type = UDP_SEGMENT;
+    ctl.hdr.cmsg_len = CMSG_LEN(sizeof(u16));
+    *(u16 *)CMSG_DATA(&ctl.hdr) = dev->packet_size;
+    msg.msg_control = &ctl;
+    msg.msg_controllen = sizeof(ctl.buf);
+    msg.msg_name = &dst->addr;
+    msg.msg_namelen = sizeof(dst->addr);
+
+    ret = scream_sendmsg(dev, d, &msg, iov, nvec, len);
+    if (ret == -EINVAL || ret == -EIO || ret == -EOPNOTSUPP || ret == -EMSGSIZE) {
+        /* No checksum offload on the route, or a segment over the MTU */
+        pr_info(DRIVER_NAME ": card %d: UDP GSO unavailable (%d), sending per packet\n",
+                dev->index, ret);
+        dev->udp_gso = false;
+        return false;
+    }
+    if (ret < 0) {
+        atomic64_inc(&dst->errors);
+        dst->last_err = ret;
+        if (ret == -EAGAIN || ret == -ENOBUFS)
+            dev->stats.drops += npkts;
+    } else {
+        atomic64_add(npkts, &dst->packets);
+        dev->stats.packets += npkts;
+        dev->stats.bytes += ret;
+        dev->stats.gso_sends++;
+    }
+    return true;
+}
+
+/* Try to send packets first..first+npkts as GSO runs. Returns how many
+ * receivers got them; the caller sends per packet to the rest. */
+static unsigned int scream_send_gso_run(struct snd_scream_device *dev, struct kvec *iov,
+                                        unsigned int first, unsigned int npkts)
+{
+    unsigned int k, d, nvec = 0;
+
+    /* Segments must be equal-sized: batches with short packets go per packet */
+    if (!dev->udp_gso || npkts < 2 || dev->tx_short)
+        return 0;
+    for (k = 0; k < npkts; k++)
+        nvec += dev->tx_nvec[first + k];
+    for (d = 0; d < dev->num_dests; d++)
+        if (!scream_send_gso(dev, d, iov, nvec, npkts))
+            break;
+    return d;
+}
+#endif
+
+/* Send npkts packets described by tx_iov/tx_nvec. UDP keeps one datagram per
+ * packet and receiver; sends never block, so a receiver that errors out only
+ * bumps its own counters. With udp_gso, runs of packets go to each receiver
+ * in one call instead. TCP hands the whole batch to the stream in a single
+ * call. */
+static void scream_send_packets(struct snd_scream_device *dev, unsigned int npkts)
+{
+    struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
+    struct kvec *iov = dev->tx_iov;
+    size_t total = (size_t)npkts * dev->packet_size;
+    unsigned int i, d, nvec = 0;
+    int ret, more;
+
+    /* A receiver that closed its end still takes writes until its reset
+     * arrives; with a standby at hand, switch as soon as the state shows it */
+    if (dev->is_tcp && dev->num_targets > 1 &&
+        atomic_read(&dev->connection_state) == STATE_CONNECTED &&
+        READ_ONCE(dev->sock->sk->sk_state) != TCP_ESTABLISHED)
+        scream_tcp_fail(dev, -EPIPE, 100);
+    if (dev->is_tcp && atomic_read(&dev->connection_state) != STATE_CONNECTED)
+        return;
+
+    if (!dev->is_tcp) {
+        unsigned int sent = 0;
+#ifdef SCREAM_HAVE_UDP_GSO
+        /* A GSO send may not exceed one maximal UDP datagram */
+        unsigned int run = min_t(unsigned int, npkts,
+                                 (0xffff - SCREAM_IPV4_UDP_OVERHEAD) / dev->packet_size);
+#endif
+
+        for (i = 0; i < npkts; i++) {
+            bool short_pkt = dev->tx_short & (1u << i);
+
+#ifdef SCREAM_HAVE_UDP_GSO
+            if (i % run == 0)
+                sent = scream_send_gso_run(dev, iov, i, min(run, npkts - i));
+#endif
+            for (d = sent; d < dev->num_dests; d++)
+                scream_send_udp(dev, d, iov, dev->tx_nvec[i],
+                                short_pkt ? iov->iov_len : dev->packet_size);
+            /* Parity covers full-size packets only */
+            if (dev->fec_n && !short_pkt)
+                scream_fec_add(dev, iov, dev->tx_nvec[i]);
+            iov += dev->tx_nvec[i];
+        }
+        return;
+    }
+
+    for (i = 0; i < npkts; i++)
+        nvec += dev->tx_nvec[i];
+    if (scream_backlog_on(dev) && dev->bl_len) {
+        /* Still behind: new audio waits its turn */
+        scream_backlog_queue(dev, dev->tx_iov, nvec, total, 0);
+        return;
+    }
+    more = scream_tcp_more(dev, npkts);
+    if (more)
+        dev->stats.tcp_corked++;
+    msg.msg_flags |= more;
+    if (dev->tx_page)
+        ret = scream_sendpage(dev, dev->tx_page, total, more);
+    else
+        ret = scream_sendmsg(dev, -1, &msg, dev->tx_iov, nvec, total);
+    if (ret < 0) {
+        atomic64_inc(&dev->dests[0].errors);
+        dev->dests[0].last_err = ret;
+        if (ret != -EAGAIN && ret != -ENOBUFS)
+            scream_tcp_fail(dev, ret, scream_reconnect_delay_ms_for_err(ret));
+        else if (scream_backlog_on(dev))
+            scream_backlog_queue(dev, dev->tx_iov, nvec, total, 0);
+        else
+            dev->stats.drops += npkts;
+    } else if ((size_t)ret == total) {
+        atomic64_add(npkts, &dev->dests[0].packets);
+        dev->stats.packets += npkts;
+        dev->stats.bytes += ret;
+    } else {
+        dev->stats.partial_sends++;
+        dev->stats.bytes += ret;
+        dev->stats.packets += ret / dev->packet_size;
+        atomic64_add(ret / dev->packet_size, &dev->dests[0].packets);
+        if (scream_backlog_on(dev))
+            scream_backlog_queue(dev, dev->tx_iov, nvec, total, ret);
+        else
+            scream_tcp_fail(dev, ret, 100);  /* receiver would lose framing */
+    }
+}
+
+/* ------------------------------
+ *      Shared tx engine
+ * ------------------------------ */
+static void scream_hist_add(u64 *hist, s64 ns)
+{
+    u64 us = ns > 0 ? div_u64(ns, NSEC_PER_USEC) : 0;
+
+    hist[us ? min_t(unsigned int, fls64(us), SCREAM_HIST_BUCKETS - 1) : 0]++;
+}
+
+/* Exact pacing: byte n of the stream is due at tx_anchor + n / byte_rate.
+ * The anchor moves forward a whole second at a time, so no rounding error
+ * builds up against the sample clock. */
+static void scream_pacing_advance(struct snd_scream_device *dev, ktime_t now, unsigned int npkts)
+{
+    s64 packet_ns = ktime_to_ns(dev->period_time_ns);
+    s64 ns;
+
+    if (dev->tx_first || dev->tx_starved ||
+        ktime_to_ns(ktime_sub(now, dev->next_wake)) > 4 * packet_ns) {
+        /* First packet, end of an underrun or a long stall: restart the timeline */
+        if (!dev->tx_first && !dev->tx_starved)
+            dev->stats.timeline_resets++;
+        dev->tx_anchor = now;
+        dev->tx_bytes = 0;
+        dev->tx_first = false;
+        dev->tx_starved = false;
+    } else {
+        s64 late = ktime_to_ns(ktime_sub(now, dev->next_wake));
+        s64 err = ktime_to_ns(ktime_sub(now, dev->last_tx)) - packet_ns * dev->last_npkts;
+
+        trace_scream_pacing(dev->index, ktime_to_ns(dev->next_wake), ktime_to_ns(now), npkts);
+        if (late < 0) late = 0;
+        if (err < 0) err = -err;
+        dev->stats.late_sum_ns += late;
+        dev->stats.late_max_ns = max_t(u64, dev->stats.late_max_ns, late);
+        dev->stats.jit_sum_ns += err;
+        dev->stats.jit_max_ns = max_t(u64, dev->stats.jit_max_ns, err);
+        dev->stats.jit_samples++;
+        scream_hist_add(dev->stats.late_hist, late);
+    }
+
+    dev->tx_bytes += (u64)npkts * dev->src_payload_size;
+    while (dev->tx_bytes >= dev->byte_rate) {
+        dev->tx_bytes -= dev->byte_rate;
+        dev->tx_anchor = ktime_add_ns(dev->tx_anchor, NSEC_PER_SEC - dev->trim_ppb);
+    }
+    ns = div64_u64(dev->tx_bytes * NSEC_PER_SEC, dev->byte_rate);
+    ns -= div_s64(ns * dev->trim_ppb, NSEC_PER_SEC);
+    dev->next_wake = ktime_add_ns(dev->tx_anchor, ns);
+    dev->last_tx = now;
+    dev->last_npkts = npkts;
+}
+
+/* Header size, and the per-packet header copies in network_buffer, for the
+ * current ext_on. Also called between batches when a receiver asks for the
+ * extended header mid-stream. */
+static void scream_set_layout(struct snd_scream_device *dev)
+{
+    unsigned int i;
+
+    dev->hdr_size = dev->ext_on ? SCREAM_EXT_HEADER_SIZE : SCREAM_HEADER_SIZE;
+    dev->packet_size = dev->hdr_size + dev->payload_size;
+    dev->network_buffer[4] = dev->ext_on ? SCREAM_FLAG_EXT : 0;
+    /* Every packet in the batch carries its own copy of the header */
+    for (i = 1; i < SCREAM_MAX_BATCH; i++)
+        memcpy(dev->network_buffer + i * dev->packet_size, dev->network_buffer, dev->hdr_size);
+    dev->bl_limit = scream_backlog_limit(dev);
+}
+
+/* ------------------------------
+ *      Receiver feedback
+ * ------------------------------ */
+/* A receiver may report its buffer fill: over UDP as a datagram back to the
+ * port the stream comes from, over TCP on the same connection.
+ *
+ *   0  'S' 'C' 'F' 'B'
+ *   4  fill in microseconds, 32-bit little endian
+ *
+ * A PI controller turns the distance from fb_target_us into a rate trim.
+ * The same channel carries the SCXH capability record from scream_proto.h.
+ * That one changes the packets of every destination, so it only counts
+ * from the stream's sole receiver: the TCP peer, or over UDP the one
+ * unicast destination, by source address. */
+#define SCREAM_FB_MAGIC "SCFB"
+#define SCREAM_FB_SIZE 8
+#define SCREAM_FB_KP 50             /* ppb per us of fill error */
+#define SCREAM_FB_KI 1              /* ppb per us of error, per report */
+#define SCREAM_FB_POLL_US 5000
+
+static void scream_set_trim(struct snd_scream_device *dev, s64 trim)
+{
+    if (trim == dev->trim_ppb)
+        return;
+    /* Carry on from the current deadline at the new rate */
+    if (!dev->tx_first) {
+        dev->tx_anchor = dev->next_wake;
+        dev->tx_bytes = 0;
+    }
+    dev->trim_ppb = trim;
+}
+
+static void scream_feedback_apply(struct snd_scream_device *dev, const u8 *rec)
+{
+    s64 max_ppb = (s64)clamp_t(int, fb_max_ppm, 0, 10000) * 1000;
+    u32 fill = rec[4] | rec[5] << 8 | rec[6] << 16 | (u32)rec[7] << 24;
+    s64 err = (s64)fill - fb_target_us;
+    s64 trim;
+
+    dev->fb_fill_us = fill;
+    dev->fb_reports++;
+    dev->fb_integral = clamp_t(s64, dev->fb_integral + err,
+                               -max_ppb / SCREAM_FB_KI, max_ppb / SCREAM_FB_KI);
+    /* A fuller receiver means we are sending too fast */
+    trim = -(err * SCREAM_FB_KP + dev->fb_integral * SCREAM_FB_KI);
+    scream_set_trim(dev, clamp_t(s64, trim, -max_ppb, max_ppb));
+}
+
+/* One 8-byte record from a receiver; false if it is not one we know.
+ * sole: it comes from the only receiver of the stream. */
+static bool scream_feedback_record(struct snd_scream_device *dev, const u8 *rec, bool sole)
+{
+    if (!memcmp(rec, SCREAM_FB_MAGIC, 4)) {
+        if (feedback)
+            scream_feedback_apply(dev, rec);
+        return true;
+    }
+    if (!memcmp(rec, SCREAM_XH_MAGIC, 4)) {
+        if (sole && (rec[4] & SCREAM_CAP_EXT_HEADER))
+            dev->ext_asked = true;
+        return true;
+    }
+    return false;
+}
+
+/* Drain pending reports without blocking. Called with tx_mutex held, like
+ * the send path, so the socket stays put. */
+static void scream_feedback_poll(struct snd_scream_device *dev, ktime_t now)
+{
+    struct msghdr msg = { .msg_flags = MSG_DONTWAIT };
+    struct sockaddr_in from;
+    struct kvec iov;
+    int ret, n;
+
+    if (!feedback) {
+        dev->fb_integral = 0;
+        scream_set_trim(dev, 0);
+        if (ext_header != 2)
+            return;
+    }
+    /* Switch on a packet boundary, once nothing of the old size is queued */
+    if (dev->ext_asked && !dev->ext_on && ext_header == 2 && !dev->bl_len) {
+        dev->ext_on = true;
+        scream_set_layout(dev);
+    }
+    if (ktime_compare(now, dev->fb_next_poll) < 0)
+        return;
+    dev->fb_next_poll = ktime_add_us(now, SCREAM_FB_POLL_US);
+    if (!dev->sock || atomic_read(&dev->connection_state) != STATE_CONNECTED)
+        return;
+
+    for (n = 0; n < 16; n++) {
+        iov.iov_base = dev->fb_buf + dev->fb_len;
+        iov.iov_len = sizeof(dev->fb_buf) - dev->fb_len;
+        msg.msg_name = dev->is_tcp ? NULL : &from;
+        msg.msg_namelen = dev->is_tcp ? 0 : sizeof(from);
+        ret = kernel_recvmsg(dev->sock, &msg, &iov, 1, iov.iov_len, MSG_DONTWAIT);
+        if (ret <= 0)
+            break;
+        if (!dev->is_tcp) {
+            if (ret >= SCREAM_FB_SIZE)
+                scream_feedback_record(dev, dev->fb_buf, dev->num_dests == 1 &&
+                                       from.sin_addr.s_addr == dev->dests[0].addr.sin_addr.s_addr);
+            continue;
+        }
+        /* TCP is a byte stream: take whole records, resync on the magic */
+        dev->fb_len += ret;
+        while (dev->fb_len >= SCREAM_FB_SIZE) {
+            unsigned int skip = 1;
+
+            if (scream_feedback_record(dev, dev->fb_buf, true))
+                skip = SCREAM_FB_SIZE;
+            dev->fb_len -= skip;
+            memmove(dev->fb_buf, dev->fb_buf + skip, dev->fb_len);
+        }
+    }
+}
+
+static void scream_send_timed(struct snd_scream_device *dev, unsigned int npkts)
+{
+    ktime_t t0 = ktime_get();
+
+    scream_send_packets(dev, npkts);
+    scream_hist_add(dev->stats.send_hist, ktime_to_ns(ktime_sub(ktime_get(), t0)));
+}
+
+/* Send whatever one stream has due. Returns false when the stream is idle,
+ * otherwise stores the time it wants to be serviced again in *due.
+ * Called from the engine thread with the engine lock held. */
+static bool scream_tx_service(struct snd_scream_device *dev, ktime_t *due)
+{
+    struct snd_pcm_substream *sub;
+    struct snd_pcm_runtime *rt;
+    unsigned long flags;
+    snd_pcm_sframes_t avail_fr;
+    unsigned int npkts = 0, i;
+    size_t pos = 0, buf_bytes = 0;
+    bool zc = false, running, stalled = false;
+    unsigned int pkt_frames = 0;
+    s64 stamp = 0;
+    ktime_t now = ktime_get();
+
+    if (!dev->tx_first && !dev->tx_starved && ktime_compare(now, dev->next_wake) < 0) {
+        *due = dev->next_wake;
+        return true;
+    }
+
+    /* tx_mutex keeps the ring in place while it is read; dev->lock only
+     * covers the substream coming and going */
+    mutex_lock(&dev->tx_mutex);
+    spin_lock_irqsave(&dev->lock, flags);
+    running = dev->is_running;
+    sub = dev->substream;
+    spin_unlock_irqrestore(&dev->lock, flags);
+    if (!running || !sub) {
+        mutex_unlock(&dev->tx_mutex);
+        dev->tx_first = true;
+        return false;
+    }
+
+    rt = sub->runtime;
+    avail_fr = snd_pcm_playback_hw_avail(rt);
+    if (avail_fr < 0) avail_fr = 0;
+    if (scream_backlog_on(dev) && dev->bl_len)
+        scream_backlog_flush(dev);
+
+    if (frames_to_bytes(rt, avail_fr) >= dev->src_payload_size) {
+        unsigned int ready = frames_to_bytes(rt, avail_fr) / dev->src_payload_size;
+
+        buf_bytes = frames_to_bytes(rt, rt->buffer_size);
+        npkts = min(ready, dev->tx_batch);
+        if (scream_backlog_on(dev) && dev->bl_len && scream_backlog_stalls() &&
+            atomic_read(&dev->connection_state) == STATE_CONNECTED) {
+            /* Take from the ring only what the backlog can hold; the
+             * rest waits in the ALSA buffer */
+            npkts = min_t(unsigned int, npkts, scream_backlog_room(dev) / dev->packet_size);
+            if (!npkts) {
+                stalled = true;
+                dev->stats.bl_stalls++;
+            }
+        }
+    }
+    if (npkts) {
+        pos = dev->hw_ptr;
+        /* With a TCP page pool the batch is copied once into a pool
+         * buffer and the socket only takes references to it */
+        zc = zerocopy && !dev->is_dsd && !dev->needs_convert && !(dev->is_tcp && dev->zc_pool[0]);
+        trace_scream_build(dev->index, npkts, pos, zc);
+        stamp = ktime_to_ns(ktime_get());
+        pkt_frames = dev->payload_size / (dev->wire_sample_bytes * dev->channels);
+    }
+
+    if (npkts && !zc) {
+        u8 *base = dev->network_buffer;
+
+        dev->tx_page = scream_zc_take(dev);
+        if (dev->tx_page)
+            base = page_address(dev->tx_page);
+        for (i = 0; i < npkts; i++) {
+            if (dev->tx_page)
+                memcpy(base + i * dev->packet_size, dev->network_buffer, dev->hdr_size);
+            scream_build_payload(dev, rt, pos, base + i * dev->packet_size + dev->hdr_size);
+            dev->tx_iov[i].iov_base = base + i * dev->packet_size;
+            dev->tx_iov[i].iov_len = dev->packet_size;
+            dev->tx_nvec[i] = 1;
+            pos = (pos + dev->src_payload_size) % buf_bytes;
+        }
+        /* Copied out, the application may reuse that part of the ring */
+        scream_publish_hw_ptr(dev, pos);
+
+        if (dev->is_dsd) {
+            for (i = 0; i < npkts; i++)
+                scream_convert_dsd((char *)base + i * dev->packet_size + dev->hdr_size,
+                                   dev->payload_size / 8);
+        }
+        scream_send_timed(dev, scream_finish_batch(dev, npkts, stamp, pkt_frames));
+        dev->tx_page = NULL;
+        dev->stats.copy_packets += npkts;
+    } else if (npkts) {
+        /* The ring cannot be freed or re-prepared while tx_mutex is held,
+         * and the application cannot overwrite these bytes until hw_ptr
+         * moves past them, so the socket reads them in place. */
+        struct kvec *iov = dev->tx_iov;
+        for (i = 0; i < npkts; i++) {
+            u8 *hdr = dev->network_buffer + i * dev->packet_size;
+
+            dev->tx_nvec[i] = scream_map_payload(dev, rt, pos, hdr, iov);
+            iov += dev->tx_nvec[i];
+            pos = (pos + dev->payload_size) % buf_bytes;
+        }
+        scream_send_timed(dev, scream_finish_batch(dev, npkts, stamp, pkt_frames));
+        dev->stats.zc_packets += npkts;
+        scream_publish_hw_ptr(dev, pos);
+    } else if (dev->corked) {
+        /* Nothing to follow for now, push what MSG_MORE held back */
+        scream_tcp_flush(dev);
+    }
+    scream_feedback_poll(dev, now);
+    mutex_unlock(&dev->tx_mutex);
+
+    if (stalled) {
+        /* Backlog full: retry it one packet interval from now */
+        *due = ktime_add_ns(now, ktime_to_ns(dev->period_time_ns));
+        return true;
+    }
+    if (!npkts) {
+        /* Short of a payload: .ack kicks us when the application writes,
+         * one packet interval is only a fallback */
+        if (!dev->tx_first && !dev->tx_starved)
+            dev->stats.underruns++;
+        dev->tx_starved = true;
+        *due = ktime_add_ns(now, ktime_to_ns(dev->period_time_ns));
+        return true;
+    }
+
+    /* Handle ALSA period elapsed natively */
+    dev->bytes_in_period += (size_t)npkts * dev->src_payload_size;
+    if (dev->bytes_in_period >= dev->alsa_period_bytes) {
+        dev->bytes_in_period -= dev->alsa_period_bytes;
+        trace_scream_period_elapsed(dev->index, dev->hw_ptr);
+        snd_pcm_period_elapsed(sub);
+    }
+
+    scream_pacing_advance(dev, now, npkts);
+    *due = dev->next_wake;
+    return true;
+}
+
+/* ------------------------------
+ *      Tx thread scheduling
+ * ------------------------------ */
+
+#define SCREAM_DL_MIN_PERIOD_NS (100 * NSEC_PER_USEC)   /* kernel.sched_deadline_period_min_us */
+#define SCREAM_DL_MIN_RUNTIME_NS (20 * NSEC_PER_USEC)
+
+static struct cpumask scream_tx_cpumask;
+static bool scream_tx_pinned;
+
+static bool scream_tx_deadline(void)
+{
+#ifdef SCHED_DEADLINE
+    return sysfs_streq(tx_sched, "deadline");
+#else
+    return false;
+#endif
+}
+
+static int scream_sched_fifo(void)
+{
+    int prio = clamp_t(int, tx_prio, 1, MAX_RT_PRIO - 1);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+    struct sched_attr attr = {
+        .size = sizeof(attr),
+        .sched_policy = SCHED_FIFO,
+        .sched_priority = prio,
+    };
+
+    return sched_setattr_nocheck(current, &attr);
+#else
+    struct sched_param param = { .sched_priority = prio };
+
+    return sched_setscheduler(current, SCHED_FIFO, &param);
+#endif
+}
+
+/*
+ * Size the calling engine's reservation for nstreams streams, the busiest
+ * waking every period_ns: tx_dl_pct of that interval per stream, plus the
+ * pacing spin, which burns runtime too. Only asked for again when the
+ * numbers change; a refusal (admission control, or an affinity narrower
+ * than the root domain) leaves the thread on SCHED_FIFO.
+ */
+static void scream_sched_reserve(struct scream_tx_engine *eng, u64 period_ns, unsigned int nstreams)
+{
+#ifdef SCHED_DEADLINE
+    struct sched_attr attr = {
+        .size = sizeof(attr),
+        .sched_policy = SCHED_DEADLINE,
+    };
+    u64 runtime;
+    int ret;
+
+    period_ns = max_t(u64, period_ns, SCREAM_DL_MIN_PERIOD_NS);
+    runtime = div_u64(period_ns * clamp_t(int, tx_dl_pct, 1, 90) * nstreams, 100);
+    if (pacing_spin_us > 0)
+        runtime += (u64)min(pacing_spin_us, 1000) * NSEC_PER_USEC;
+    runtime = clamp_t(u64, runtime, SCREAM_DL_MIN_RUNTIME_NS, div_u64(period_ns * 95, 100));
+    if (runtime == eng->dl_runtime_ns && period_ns == eng->dl_period_ns)
+        return;
+    eng->dl_runtime_ns = runtime;
+    eng->dl_period_ns = period_ns;
+
+    attr.sched_runtime = runtime;
+    attr.sched_deadline = period_ns;
+    attr.sched_period = period_ns;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+    ret = sched_setattr_nocheck(current, &attr);
+#else
+    ret = sched_setattr(current, &attr);
+#endif
+    if (ret < 0) {
+        pr_warn(DRIVER_NAME ": tx thread %d: SCHED_DEADLINE %llu/%llu ns refused: %d\n",
+                (int)(eng - scream_engines), runtime, period_ns, ret);
+        if (eng->policy != SCHED_FIFO && !scream_sched_fifo())
+            eng->policy = SCHED_FIFO;
+        return;
+    }
+    eng->policy = SCHED_DEADLINE;
+#endif
+}
+
+static int scream_tx_engine_thread(void *data)
+{
+    struct scream_tx_engine *eng = data;
+    struct snd_scream_device *dev;
+    int ret;
+
+    if (scream_tx_pinned) {
+        ret = set_cpus_allowed_ptr(current, &scream_tx_cpumask);
+        if (ret < 0)
+            pr_warn(DRIVER_NAME ": tx thread %d: CPU affinity not applied: %d\n",
+                    (int)(eng - scream_engines), ret);
+    }
+    /* FIFO until a stream tells us what to reserve, then deadline if asked for */
+    ret = scream_sched_fifo();
+    if (ret < 0)
+        pr_warn(DRIVER_NAME ": tx thread %d: SCHED_FIFO not applied: %d\n",
+                (int)(eng - scream_engines), ret);
+    else
+        eng->policy = SCHED_FIFO;
+
+    while (!kthread_should_stop()) {
+        ktime_t wake = ktime_set(0, 0), due;
+        bool timed = false;
+        u64 period_ns = 0;
+        unsigned int nstreams = 0;
+
+        atomic_set(&eng->kick, 0);
+        mutex_lock(&eng->lock);
+        list_for_each_entry(dev, &eng->streams, tx_node) {
+            u64 interval = (u64)ktime_to_ns(dev->period_time_ns) * dev->tx_batch;
+
+            if (scream_tx_service(dev, &due) &&
+                (!timed || ktime_compare(due, wake) < 0)) {
+                wake = due;
+                timed = true;
+            }
+            if (interval) {
+                nstreams++;
+                if (!period_ns || interval < period_ns)
+                    period_ns = interval;
+            }
+        }
+        mutex_unlock(&eng->lock);
+        /* With no streams left the reservation stays: an idle deadline
+         * task costs nothing and the next stream gets it back at once */
+        if (nstreams && scream_tx_deadline())
+            scream_sched_reserve(eng, period_ns, nstreams);
+
+        /* A start that raced with the scan sets kick and wakes us up */
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (atomic_read(&eng->kick) || kthread_should_stop()) {
+            __set_current_state(TASK_RUNNING);
+            continue;
+        }
+        if (timed && pacing_spin_us > 0) {
+            ktime_t coarse = ktime_sub_us(wake, clamp_t(int, pacing_spin_us, 1, 1000));
+
+            if (ktime_compare(coarse, ktime_get()) > 0)
+                schedule_hrtimeout(&coarse, HRTIMER_MODE_ABS);
+            __set_current_state(TASK_RUNNING);
+            /* Spin out the rest for the lowest wakeup jitter */
+            while (ktime_compare(ktime_get(), wake) < 0 &&
+                   !atomic_read(&eng->kick) && !kthread_should_stop())
+                cpu_relax();
+            continue;
+        }
+        if (timed)
+            schedule_hrtimeout(&wake, HRTIMER_MODE_ABS);
+        else
+            schedule();
+        __set_current_state(TASK_RUNNING);
+    }
+    return 0;
+}
+
+static void scream_tx_engines_stop(void)
+{
+    int i;
+
+    for (i = 0; i < scream_num_engines; i++) {
+        if (scream_engines[i].thread) {
+            kthread_stop(scream_engines[i].thread);
+            scream_engines[i].thread = NULL;
+        }
+    }
+}
+
+static int scream_tx_engines_start(void)
+{
+    int i;
+
+    if (tx_cpus[0]) {
+        if (cpulist_parse(tx_cpus, &scream_tx_cpumask) < 0 ||
+            !cpumask_intersects(&scream_tx_cpumask, cpu_online_mask)) {
+            pr_err(DRIVER_NAME ": tx_cpus '%s' names no online CPU\n", tx_cpus);
+            return -EINVAL;
+        }
+        scream_tx_pinned = true;
+    }
+    if (tx_sched[0] && !sysfs_streq(tx_sched, "fifo") && !sysfs_streq(tx_sched, "deadline"))
+        pr_warn(DRIVER_NAME ": tx_sched '%s' unknown, using fifo\n", tx_sched);
+    else if (sysfs_streq(tx_sched, "deadline") && !scream_tx_deadline())
+        pr_warn(DRIVER_NAME ": SCHED_DEADLINE not available, using fifo\n");
+
+    scream_num_engines = clamp_t(int, tx_threads, 1, SCREAM_MAX_TX_THREADS);
+    for (i = 0; i < scream_num_engines; i++) {
+        mutex_init(&scream_engines[i].lock);
+        INIT_LIST_HEAD(&scream_engines[i].streams);
+        atomic_set(&scream_engines[i].kick, 0);
+    }
+    for (i = 0; i < scream_num_engines; i++) {
+        struct task_struct *thd = kthread_run(scream_tx_engine_thread, &scream_engines[i],
+                                              "scream_tx/%d", i);
+        if (IS_ERR(thd)) {
+            pr_err(DRIVER_NAME ": Failed to create tx thread %d\n", i);
+            scream_tx_engines_stop();
+            return PTR_ERR(thd);
+        }
+        scream_engines[i].thread = thd;
+    }
+    return 0;
+}
+
+/* Buffers the transport needs beyond the socket; kept once allocated */
+static void scream_transport_alloc(struct snd_scream_device *dev, bool is_tcp)
+{
+    if (!is_tcp && lz4)
+        scream_lz4_alloc(dev);
+    if (is_tcp && tcp_backlog_ms > 0 && !dev->bl_buf) {
+        dev->bl_buf = vmalloc(SCREAM_BACKLOG_BYTES);
+        if (!dev->bl_buf)
+            pr_warn(DRIVER_NAME ": card %d: no memory for the TCP backlog\n", dev->index);
+    }
+}
+
+/* The card's settings: the module parameters until a control is written.
+ * Called with live_lock held. */
+static void scream_live_get_cfg(struct snd_scream_device *dev, struct scream_live_cfg *cfg)
+{
+    if (dev->live_set) {
+        *cfg = dev->live;
+        return;
+    }
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->addr.sin_family = AF_INET;
+    cfg->addr.sin_port = htons(scream_card_port(dev->index));
+    cfg->addr.sin_addr.s_addr = in_aton(scream_card_ip(dev->index));
+    cfg->is_tcp = scream_card_is_tcp(dev->index);
+    cfg->adaptive = scream_adaptive_payload();
+}
+
+static int snd_scream_pcm_open(struct snd_pcm_substream *substream)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    struct scream_live_cfg cfg;
+    int ret;
+
+    /* A control change waits until the stream is set up, then applies to it */
+    mutex_lock(&dev->live_lock);
+    scream_live_get_cfg(dev, &cfg);
+    atomic_set(&dev->closing, 0);
+    dev->substream = substream;
+    runtime->hw = snd_scream_hw;
+    /* A period must hold at least one packet of the largest payload we may pick */
+    runtime->hw.period_bytes_min = scream_max_payload(cfg.adaptive, cfg.is_tcp ? 0 : dev->fec_n);
+    runtime->hw.period_bytes_max = runtime->hw.period_bytes_min * 128;
+    ret = snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+    if (ret < 0)
+        goto out;
+    ret = 0;
+    dev->is_tcp = cfg.is_tcp;
+    dev->adaptive = cfg.adaptive;
+    dev->batch_cfg = cfg.batch;
+    dev->corked = false;
+    dev->ext_asked = false;     /* receivers ask again for every stream */
+    scream_transport_alloc(dev, dev->is_tcp);
+#ifdef SCREAM_HAVE_UDP_GSO
+    dev->udp_gso = udp_gso && !dev->is_tcp;
+#endif
+    scream_tx_attach(dev);
+
+    /* Reuse existing socket for seamless track switching */
+    if (dev->sock) {
+        if (dev->is_tcp &&
             atomic_read(&dev->connection_state) != STATE_DISCONNECTED)
-            return 0;  /* TCP connected/connecting - reuse */
+            goto out;  /* TCP connected/connecting - reuse */
         if (!dev->is_tcp)
-            return 0;  /* UDP - always reuse */
+            goto out;  /* UDP - always reuse */
+
+        /* TCP disconnected - clean up stale socket */
+        atomic_set(&dev->closing, 1);
+        cancel_delayed_work_sync(&dev->reconnect_work);
+        cancel_delayed_work_sync(&dev->fo_work);
+        sock_release(dev->sock);
+        dev->sock = NULL;
+        atomic_set(&dev->connection_state, STATE_DISCONNECTED);
+        atomic_set(&dev->reconnect_attempts, 0);
+        atomic_set(&dev->closing, 0);
+    }
+
+    ret = SCREAM_SOCK_CREATE(AF_INET,
+                           dev->is_tcp ? SOCK_STREAM : SOCK_DGRAM,
+                           dev->is_tcp ? IPPROTO_TCP : IPPROTO_UDP,
+                           &dev->sock);
+    if (ret < 0) {
+        scream_tx_detach(dev);
+        goto out;
+    }
+
+    dev->remote_addr = cfg.addr;
+    if (dev->is_tcp)
+        scream_setup_targets(dev);
+    scream_setup_dests(dev);
+
+    if (dev->is_tcp) {
+        atomic_set(&dev->connection_state, STATE_DISCONNECTED);
+        {
+            int opt = 1;
+            SET_PROTO_SOCKOPT(dev->sock, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            opt = 1;
+            SET_SOCKOPT(dev->sock, SOL_SOCKET, SO_KEEPALIVE, (char *)&opt, sizeof(opt));
+            opt = 3000;
+            SET_PROTO_SOCKOPT(dev->sock, SOL_TCP, TCP_USER_TIMEOUT, &opt, sizeof(opt));
+        }
+        schedule_delayed_work(&dev->reconnect_work, msecs_to_jiffies(100));
+        if (dev->num_targets > 1)
+            schedule_delayed_work(&dev->fo_work, 0);
+    } else {
+        scream_setup_multicast(dev);
+        atomic_set(&dev->connection_state, STATE_CONNECTED);
+    }
+
+out:
+    mutex_unlock(&dev->live_lock);
+    return ret;
+}
+
+static int snd_scream_pcm_close(struct snd_pcm_substream *substream)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+    unsigned long flags;
+
+    /* Stop playback first if still running */
+    spin_lock_irqsave(&dev->lock, flags);
+    dev->is_running = false;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    scream_tx_detach(dev);
+
+    /* Send end-of-track marker */
+    if (dev->sock && atomic_read(&dev->connection_state) == STATE_CONNECTED) {
+        scream_send_last_packet(dev);
+    }
+
+    /* Keep socket alive for seamless track switching */
+    spin_lock_irqsave(&dev->lock, flags);
+    dev->substream = NULL;
+    spin_unlock_irqrestore(&dev->lock, flags);
+    return 0;
+}
+
+/* Header byte 0: bit 7 set = multiple of 44100, else multiple of 48000.
+ * DSD streams carry half the ALSA DSD_U32 rate. */
+static u8 scream_rate_byte(unsigned int rate, bool is_dsd)
+{
+    unsigned int srt = is_dsd ? rate / 2 : rate;
+
+    return (u8)((srt % 44100) ? (0 + (srt / 48000)) : (128 + (srt / 44100)));
+}
+
+/* Audio time carried by one packet of payload bytes */
+static ktime_t scream_packet_time(size_t payload, unsigned int rate, unsigned int frame_bytes)
+{
+    u64 num = (u64)payload * 1000000000ULL; /* bytes * 1e9 */
+
+    do_div(num, (u32)(rate * frame_bytes)); /* -> nanoseconds per payload */
+    return ktime_set(0, (unsigned long)num);
+}
+
+/* Packets per wakeup: want (tx_batch or the card's control), trimmed so that
+ * a batch never spans more than tx_batch_us of audio. Low-rate streams fall
+ * back to one-packet pacing. */
+static unsigned int scream_batch_for_stream(int want, s64 packet_ns)
+{
+    unsigned int batch = clamp_t(int, want, 1, SCREAM_MAX_BATCH);
+
+    if (tx_batch_us > 0 && packet_ns > 0) {
+        u64 budget = (u64)tx_batch_us * NSEC_PER_USEC;
+        u64 fit = div64_u64(budget, (u64)packet_ns);
+        batch = (unsigned int)clamp_t(u64, fit, 1, batch);
+    }
+    return batch;
+}
+
+/* Payload, packet time and batch for the negotiated format and the card's
+ * policy, then the header layout. Run by hw_params, and between batches
+ * when a control changes the policy or batch size mid-stream. */
+static void scream_stream_layout(struct snd_scream_device *dev)
+{
+    unsigned int frame_bytes = dev->wire_sample_bytes * dev->channels;  /* on the wire */
+    unsigned int unit = dev->is_dsd && frame_bytes % 8 ? 2 * frame_bytes : frame_bytes;
+    size_t period = dev->alsa_period_bytes / dev->src_sample_bytes * dev->wire_sample_bytes;
+
+    dev->payload_size = scream_payload_for_stream(dev->adaptive, dev->sample_rate, frame_bytes, dev->is_dsd,
+                                                  dev->is_tcp ? 0 : dev->fec_n);
+    /* A stream opened as 'fixed' may have periods shorter than an adaptive packet */
+    if (period >= unit && dev->payload_size > period)
+        dev->payload_size = rounddown(period, unit);
+    dev->src_payload_size = dev->payload_size / dev->wire_sample_bytes * dev->src_sample_bytes;
+    dev->period_time_ns = scream_packet_time(dev->payload_size, dev->sample_rate, frame_bytes);
+    dev->tx_batch = scream_batch_for_stream(dev->batch_cfg ? dev->batch_cfg : tx_batch,
+                                            ktime_to_ns(dev->period_time_ns));
+    scream_set_layout(dev);
+    scream_zc_pool_fit(dev);
+}
+
+static int snd_scream_pcm_hw_params(struct snd_pcm_substream *substream, struct snd_pcm_hw_params *params)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+    int ret;
+
+    mutex_lock(&dev->tx_mutex);
+    ret = snd_pcm_lib_malloc_pages(substream, params_buffer_bytes(params));
+    mutex_unlock(&dev->tx_mutex);
+    if (ret < 0)
+        return ret;
+
+    dev->sample_rate = params_rate(params);
+    dev->channels = params_channels(params);
+    dev->format = params_format(params);
+
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
+#ifdef SNDRV_PCM_FORMAT_DSD_U32_BE
+    dev->is_dsd = (dev->format == SNDRV_PCM_FORMAT_DSD_U32_BE);
+#else
+    dev->is_dsd = false;
+#endif
+#else
+    dev->is_dsd = false;
+#endif
+
+    dev->src_sample_bytes = snd_pcm_format_physical_width(dev->format) / 8;
+    dev->frame_bytes = dev->src_sample_bytes * dev->channels;
+    dev->wire_sample_bytes = 4;
+    if (wire_native && (dev->format == SNDRV_PCM_FORMAT_S16_LE ||
+                        dev->format == SNDRV_PCM_FORMAT_S24_3LE))
+        dev->wire_sample_bytes = dev->src_sample_bytes;
+    dev->needs_convert = dev->wire_sample_bytes != dev->src_sample_bytes ||
+                         dev->format == SNDRV_PCM_FORMAT_S24_LE ||
+                         dev->format == SNDRV_PCM_FORMAT_FLOAT_LE;
+
+    /* Scream 5-byte header */
+    if (dev->is_dsd)
+        dev->network_buffer[1] = 1;      /* DSD marker */
+    else
+        dev->network_buffer[1] = (u8)(dev->wire_sample_bytes * 8);  /* PCM bits on the wire */
+
+    dev->network_buffer[0] = scream_rate_byte(dev->sample_rate, dev->is_dsd);
+    dev->network_buffer[2] = (u8)dev->channels;
+    dev->network_buffer[3] = ch_mask[dev->channels];
+    dev->network_buffer[4] = 0;
+     /* Pacing itself runs on the untruncated byte rate */
+     dev->byte_rate = (u64)dev->sample_rate * dev->frame_bytes;
+     dev->alsa_period_bytes = params_period_size(params) * dev->frame_bytes;
+     dev->bytes_in_period = 0;
+     dev->ext_on = ext_header == 1 || (ext_header == 2 && dev->ext_asked);
+     scream_stream_layout(dev);
+
+    return 0;
+}
+
+static int snd_scream_pcm_hw_free(struct snd_pcm_substream *substream)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+    int ret;
+
+    /* Wait for a zero-copy send still reading from the ring */
+    mutex_lock(&dev->tx_mutex);
+    ret = snd_pcm_lib_free_pages(substream);
+    mutex_unlock(&dev->tx_mutex);
+    return ret;
+}
+
+static int snd_scream_pcm_prepare(struct snd_pcm_substream *substream)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+    mutex_lock(&dev->tx_mutex);
+    scream_publish_hw_ptr(dev, 0);
+    dev->fec_fill = 0;      /* payload size may have changed */
+    dev->tx_frames = 0;
+    mutex_unlock(&dev->tx_mutex);
+    substream->runtime->start_threshold = substream->runtime->period_size;
+    substream->runtime->stop_threshold = substream->runtime->buffer_size;
+    return 0;
+}
+
+static int snd_scream_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+    unsigned long flags;
+
+    trace_scream_trigger(dev->index, cmd);
+    switch (cmd) {
+    case SNDRV_PCM_TRIGGER_START:
+        spin_lock_irqsave(&dev->lock, flags);
+        if (!dev->is_running) {
+            dev->is_running = true;
+            scream_tx_kick(dev);
+        }
+        spin_unlock_irqrestore(&dev->lock, flags);
+        break;
+    case SNDRV_PCM_TRIGGER_STOP:
+        spin_lock_irqsave(&dev->lock, flags);
+        if (dev->is_running) {
+            dev->is_running = false;
+        }
+        spin_unlock_irqrestore(&dev->lock, flags);
+        break;
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static snd_pcm_uframes_t snd_scream_pcm_pointer(struct snd_pcm_substream *substream)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+
+    return scream_read_hw_ptr(dev) / dev->frame_bytes;
+}
+
+/* Application moved appl_ptr: wake the engine if the stream was starved */
+static int snd_scream_pcm_ack(struct snd_pcm_substream *substream)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+
+    if (dev->is_running && READ_ONCE(dev->tx_starved))
+        scream_tx_kick(dev);
+    return 0;
+}
+
+/* ioctl: forward to helper to avoid crashes */
+static int snd_scream_pcm_ioctl(struct snd_pcm_substream *substream, unsigned int cmd, void *arg)
+{
+    return snd_pcm_lib_ioctl(substream, cmd, arg);
+}
 
-        /* TCP disconnected - clean up stale socket */
-        atomic_set(&dev->closing, 1);
-        cancel_delayed_work_sync(&dev->reconnect_work);
-        sock_release(dev->sock);
-        dev->sock = NULL;
-        atomic_set(&dev->connection_state, STATE_DISCONNECTED);
-        atomic_set(&dev->reconnect_attempts, 0);
-        atomic_set(&dev->closing, 0);
+/* .page: works for both vmalloc/kmalloc */
+static struct page *snd_scream_pcm_page(struct snd_pcm_substream *substream, unsigned long offset)
+{
+    void *addr = substream->runtime->dma_area + offset;
+    return is_vmalloc_addr(addr) ? vmalloc_to_page(addr) : virt_to_page(addr);
+}
+/*
+static int scream_pcm_copy(struct snd_pcm_substream *sub, int channel,
+snd_pcm_uframes_t pos, void __user *src,
+snd_pcm_uframes_t frames)
+{
+    struct snd_pcm_runtime *rt = sub->runtime;
+    size_t bytes = frames_to_bytes(rt, frames);
+    size_t off = frames_to_bytes(rt, pos);
+    void *dst = rt->dma_area + off;
+    if (copy_from_user(dst, src, bytes))
+    return -EFAULT;
+    return 0;
+}
+
+static int scream_pcm_silence(struct snd_pcm_substream *sub, int channel,
+snd_pcm_uframes_t pos, snd_pcm_uframes_t frames)
+{
+    struct snd_pcm_runtime *rt = sub->runtime;
+    memset(rt->dma_area + frames_to_bytes(rt, pos), 0, frames_to_bytes(rt, frames));
+    return 0;
+}
+*/
+static struct snd_pcm_ops snd_scream_pcm_ops = {
+    .open = snd_scream_pcm_open,
+    .close = snd_scream_pcm_close,
+    .ioctl = snd_scream_pcm_ioctl,
+    .hw_params = snd_scream_pcm_hw_params,
+    .hw_free = snd_scream_pcm_hw_free,
+    .prepare = snd_scream_pcm_prepare,
+    .trigger = snd_scream_pcm_trigger,
+    .pointer = snd_scream_pcm_pointer,
+    .ack = snd_scream_pcm_ack,
+    .page = snd_scream_pcm_page,
+//    .copy = scream_pcm_copy,
+//    .silence = scream_pcm_silence,
+};
+
+
+/* ------------------------------
+ *      Network capture
+ * ------------------------------ */
+/* A capture substream fed by Scream senders. The socket's data-ready
+ * callback only queues cap_work, since recvmsg may sleep; the work then
+ * receives each payload straight into the capture ring. The stream format
+ * is whatever the application configured, packets that do not match it
+ * are dropped and counted. Over TCP the legacy fixed 1152-byte payload is
+ * assumed, as the stream carries no packet length. */
+static struct snd_pcm_hardware snd_scream_capture_hw = {
+    .info = SNDRV_PCM_INFO_INTERLEAVED | SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID,
+    .formats = SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_S16_LE | SNDRV_PCM_FMTBIT_S24_3LE,
+    .rates = SNDRV_PCM_RATE_CONTINUOUS | SNDRV_PCM_RATE_KNOT,
+    .rate_min = 44100,
+    .rate_max = 1536000,
+    .channels_min = 1,
+    .channels_max = 8,
+    .buffer_bytes_max = 1024 * 1024,
+    .period_bytes_min = 256,
+    .period_bytes_max = 512 * 1024,
+    .periods_min = 2,
+    .periods_max = 1024,
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+static void scream_cap_data_ready(struct sock *sk)
+#else
+static void scream_cap_data_ready(struct sock *sk, int bytes)
+#endif
+{
+    struct snd_scream_device *dev;
+
+    read_lock_bh(&sk->sk_callback_lock);
+    dev = sk->sk_user_data;
+    if (dev)
+        queue_work(system_highpri_wq, &dev->cap_work);
+    read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void scream_cap_hook(struct snd_scream_device *dev, struct socket *sock)
+{
+    struct sock *sk = sock->sk;
+
+    write_lock_bh(&sk->sk_callback_lock);
+    if (!dev->cap_orig_data_ready)
+        dev->cap_orig_data_ready = sk->sk_data_ready;
+    sk->sk_user_data = dev;
+    sk->sk_data_ready = scream_cap_data_ready;
+    write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void scream_cap_unhook(struct snd_scream_device *dev, struct socket *sock)
+{
+    struct sock *sk = sock->sk;
+
+    write_lock_bh(&sk->sk_callback_lock);
+    sk->sk_user_data = NULL;
+    sk->sk_data_ready = dev->cap_orig_data_ready;
+    write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void scream_cap_close_conn(struct snd_scream_device *dev)
+{
+    if (dev->cap_conn) {
+        scream_cap_unhook(dev, dev->cap_conn);
+        sock_release(dev->cap_conn);
+        dev->cap_conn = NULL;
+    }
+    dev->cap_off = 0;
+}
+
+static void scream_cap_teardown(struct snd_scream_device *dev)
+{
+    if (dev->cap_sock)
+        scream_cap_unhook(dev, dev->cap_sock);
+    if (dev->cap_conn)
+        scream_cap_unhook(dev, dev->cap_conn);
+    cancel_work_sync(&dev->cap_work);
+    scream_cap_close_conn(dev);
+    if (dev->cap_sock) {
+        sock_release(dev->cap_sock);
+        dev->cap_sock = NULL;
     }
+    dev->cap_orig_data_ready = NULL;
+}
+
+static int scream_cap_listen(struct snd_scream_device *dev)
+{
+    struct sockaddr_in addr;
+    struct socket *sock;
+    int opt, ret;
 
+    dev->cap_tcp = sysfs_streq(capture_protocol, "tcp");
     ret = SCREAM_SOCK_CREATE(AF_INET,
-                           dev->is_tcp ? SOCK_STREAM : SOCK_DGRAM,
-                           dev->is_tcp ? IPPROTO_TCP : IPPROTO_UDP,
-                           &dev->sock);
+                             dev->cap_tcp ? SOCK_STREAM : SOCK_DGRAM,
+                             dev->cap_tcp ? IPPROTO_TCP : IPPROTO_UDP,
+                             &sock);
     if (ret < 0)
         return ret;
 
-    memset(&dev->remote_addr, 0, sizeof(dev->remote_addr));
-    dev->remote_addr.sin_family = AF_INET;
-    dev->remote_addr.sin_port = htons(port);
-    dev->remote_addr.sin_addr.s_addr = in_aton(ip_addr_str);
+    opt = 1;
+    SET_SOCKOPT(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    opt = 1024 * 1024;
+    SET_SOCKOPT(sock, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
 
-    if (dev->is_tcp) {
-        atomic_set(&dev->connection_state, STATE_DISCONNECTED);
-        {
-            int opt = 1;
-            SET_SOCKOPT(dev->sock, SOL_TCP, TCP_NODELAY, (char *)&opt, sizeof(opt));
-            opt = 1;
-            SET_SOCKOPT(dev->sock, SOL_SOCKET, SO_KEEPALIVE, (char *)&opt, sizeof(opt));
-            opt = 3000;
-            SET_SOCKOPT(dev->sock, SOL_TCP, TCP_USER_TIMEOUT, (char *)&opt, sizeof(opt));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(capture_port + dev->index);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    ret = kernel_bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    if (!ret && dev->cap_tcp)
+        ret = kernel_listen(sock, 1);
+    if (ret < 0) {
+        pr_err(DRIVER_NAME ": card %d: cannot listen on port %d: %d\n",
+               dev->index, capture_port + dev->index, ret);
+        sock_release(sock);
+        return ret;
+    }
+
+    dev->cap_sock = sock;
+    scream_cap_hook(dev, sock);
+    return 0;
+}
+
+/* Frames the ring can take before it would overwrite unread data */
+static snd_pcm_uframes_t scream_cap_free_frames(struct snd_scream_device *dev,
+                                                struct snd_pcm_runtime *rt)
+{
+    snd_pcm_uframes_t used = (dev->cap_rx_frames + rt->boundary - rt->control->appl_ptr) % rt->boundary;
+
+    return used >= rt->buffer_size ? 0 : rt->buffer_size - used;
+}
+
+/* kvecs covering len bytes of the ring starting skip bytes past the write position */
+static unsigned int scream_cap_ring_iov(struct snd_scream_device *dev, struct snd_pcm_runtime *rt,
+                                        size_t skip, size_t len, struct kvec *iov)
+{
+    size_t buf_bytes = frames_to_bytes(rt, rt->buffer_size);
+    size_t off = (frames_to_bytes(rt, dev->cap_rx_frames % rt->buffer_size) + skip) % buf_bytes;
+
+    iov[0].iov_base = rt->dma_area + off;
+    if (off + len <= buf_bytes) {
+        iov[0].iov_len = len;
+        return 1;
+    }
+    iov[0].iov_len = buf_bytes - off;
+    iov[1].iov_base = rt->dma_area;
+    iov[1].iov_len = len - iov[0].iov_len;
+    return 2;
+}
+
+static bool scream_cap_header_ok(struct snd_pcm_runtime *rt, const u8 *hdr, size_t len)
+{
+    unsigned int rate = (hdr[0] & 0x80) ? 44100 * (hdr[0] & 0x7f) : 48000 * hdr[0];
+
+    return hdr[4] == 0 &&
+           hdr[1] == snd_pcm_format_physical_width(rt->format) &&
+           hdr[2] == rt->channels && rate == rt->rate &&
+           len && len % frames_to_bytes(rt, 1) == 0;
+}
+
+/* Account a payload that has landed in the ring and hand it to ALSA once
+ * the jitter buffer is primed */
+static void scream_cap_commit(struct snd_scream_device *dev, struct snd_pcm_runtime *rt, size_t len)
+{
+    snd_pcm_uframes_t pending;
+    ktime_t now = ktime_get();
+
+    if (dev->cap_seen && !dev->cap_priming &&
+        ktime_to_ns(ktime_sub(now, dev->cap_last_rx)) > (s64)capture_jitter_ms * NSEC_PER_MSEC) {
+        /* Sender paused or packets went missing: build the cushion again */
+        dev->cap_stats.gaps++;
+        dev->cap_priming = true;
+    }
+    dev->cap_seen = true;
+    dev->cap_last_rx = now;
+    dev->cap_stats.packets++;
+    dev->cap_stats.bytes += len;
+    dev->cap_rx_frames = (dev->cap_rx_frames + bytes_to_frames(rt, len)) % rt->boundary;
+
+    pending = (dev->cap_rx_frames + rt->boundary - dev->cap_hw_frames) % rt->boundary;
+    if (dev->cap_priming && pending < dev->cap_prefill_frames)
+        return;
+    dev->cap_priming = false;
+    scream_publish_cap_frames(dev, dev->cap_rx_frames);
+    dev->cap_period_frames += pending;
+    if (dev->cap_period_frames >= rt->period_size) {
+        dev->cap_period_frames %= rt->period_size;
+        snd_pcm_period_elapsed(dev->cap_substream);
+    }
+}
+
+static void scream_cap_rx_udp(struct snd_scream_device *dev, struct snd_pcm_runtime *rt, bool live)
+{
+    struct kvec iov[3];
+    unsigned int n;
+    int ret;
+
+    for (n = 0; n < 64; n++) {
+        struct msghdr msg = { .msg_flags = MSG_DONTWAIT };
+        size_t room = 0;
+        unsigned int nvec = 1;
+
+        iov[0].iov_base = dev->cap_hdr;
+        iov[0].iov_len = SCREAM_HEADER_SIZE;
+        if (live) {
+            room = min_t(size_t, frames_to_bytes(rt, scream_cap_free_frames(dev, rt)), SCREAM_MAX_PAYLOAD);
+            if (room)
+                nvec += scream_cap_ring_iov(dev, rt, 0, room, &iov[1]);
+        } else {
+            iov[0].iov_base = dev->cap_scratch;
+            iov[0].iov_len = SCREAM_MAX_PACKET_SIZE;
         }
-        schedule_delayed_work(&dev->reconnect_work, msecs_to_jiffies(100));
-    } else {
-        atomic_set(&dev->connection_state, STATE_CONNECTED);
+
+        ret = kernel_recvmsg(dev->cap_sock, &msg, iov, nvec, SCREAM_HEADER_SIZE + room, MSG_DONTWAIT);
+        if (ret < 0)
+            break;
+        if (!live)
+            continue;
+        if (msg.msg_flags & MSG_TRUNC) {
+            if (room < SCREAM_MAX_PAYLOAD)
+                dev->cap_stats.overruns++;
+            else
+                dev->cap_stats.mismatches++;
+            continue;
+        }
+        if (ret == SCREAM_HEADER_SIZE && (dev->cap_hdr[4] & 0x80))
+            continue;   /* end-of-track marker */
+        if (ret < SCREAM_HEADER_SIZE ||
+            !scream_cap_header_ok(rt, dev->cap_hdr, ret - SCREAM_HEADER_SIZE)) {
+            dev->cap_stats.mismatches++;
+            continue;
+        }
+        scream_cap_commit(dev, rt, ret - SCREAM_HEADER_SIZE);
+    }
+}
+
+static void scream_cap_rx_tcp(struct snd_scream_device *dev, struct snd_pcm_runtime *rt, bool live)
+{
+    struct socket *newsock;
+    struct kvec iov[2];
+    unsigned int nvec;
+    int ret;
+
+    /* Newest sender wins */
+    while (kernel_accept(dev->cap_sock, &newsock, O_NONBLOCK) == 0) {
+        scream_cap_close_conn(dev);
+        dev->cap_conn = newsock;
+        scream_cap_hook(dev, newsock);
     }
+    if (!dev->cap_conn)
+        return;
+
+    for (;;) {
+        struct msghdr msg = { .msg_flags = MSG_DONTWAIT };
+        size_t want;
+
+        if (dev->cap_off < SCREAM_HEADER_SIZE) {
+            iov[0].iov_base = dev->cap_hdr + dev->cap_off;
+            iov[0].iov_len = want = SCREAM_HEADER_SIZE - dev->cap_off;
+            nvec = 1;
+        } else {
+            size_t done = dev->cap_off - SCREAM_HEADER_SIZE;
+
+            want = SCREAM_PAYLOAD_SIZE - done;
+            if (dev->cap_drop) {
+                iov[0].iov_base = dev->cap_scratch;
+                iov[0].iov_len = want;
+                nvec = 1;
+            } else {
+                nvec = scream_cap_ring_iov(dev, rt, done, want, iov);
+            }
+        }
+
+        ret = kernel_recvmsg(dev->cap_conn, &msg, iov, nvec, want, MSG_DONTWAIT);
+        if (ret == -EAGAIN)
+            return;
+        if (ret <= 0) {
+            scream_cap_close_conn(dev);
+            return;
+        }
+        dev->cap_off += ret;
 
-    if (!dev->playback_thread) {
-        dev->playback_thread = kthread_run(scream_playback_thread, dev, "scream_tx");
-        if (IS_ERR(dev->playback_thread)) {
-            pr_err(DRIVER_NAME ": Failed to create playback thread\n");
-            dev->playback_thread = NULL;
-            return -ENOMEM;
+        if (dev->cap_off == SCREAM_HEADER_SIZE) {
+            /* Whole header: decide where the payload goes */
+            dev->cap_drop = true;
+            if (live && !(dev->cap_hdr[4] & 0x80)) {
+                if (!scream_cap_header_ok(rt, dev->cap_hdr, SCREAM_PAYLOAD_SIZE))
+                    dev->cap_stats.mismatches++;
+                else if (frames_to_bytes(rt, scream_cap_free_frames(dev, rt)) < SCREAM_PAYLOAD_SIZE)
+                    dev->cap_stats.overruns++;
+                else
+                    dev->cap_drop = false;
+            }
+        } else if (dev->cap_off == SCREAM_HEADER_SIZE + SCREAM_PAYLOAD_SIZE) {
+            if (!dev->cap_drop)
+                scream_cap_commit(dev, rt, SCREAM_PAYLOAD_SIZE);
+            dev->cap_off = 0;
         }
     }
+}
+
+static void scream_cap_work(struct work_struct *work)
+{
+    struct snd_scream_device *dev = container_of(work, struct snd_scream_device, cap_work);
+    struct snd_pcm_runtime *rt;
+    bool live;
+
+    mutex_lock(&dev->cap_mutex);
+    if (dev->cap_sock && dev->cap_substream) {
+        rt = dev->cap_substream->runtime;
+        /* Not started yet or stopped: keep the socket drained */
+        live = atomic_read(&dev->cap_running) && rt->dma_area;
+        if (dev->cap_tcp)
+            scream_cap_rx_tcp(dev, rt, live);
+        else
+            scream_cap_rx_udp(dev, rt, live);
+    }
+    mutex_unlock(&dev->cap_mutex);
+}
+
+static int snd_scream_capture_open(struct snd_pcm_substream *substream)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    int ret;
+
+    runtime->hw = snd_scream_capture_hw;
+    ret = snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+    if (ret < 0)
+        return ret;
+
+    dev->cap_substream = substream;
+    ret = scream_cap_listen(dev);
+    if (ret < 0)
+        dev->cap_substream = NULL;
+    return ret;
+}
+
+static int snd_scream_capture_close(struct snd_pcm_substream *substream)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
 
+    atomic_set(&dev->cap_running, 0);
+    scream_cap_teardown(dev);
+    dev->cap_substream = NULL;
     return 0;
 }
 
-static int snd_scream_pcm_close(struct snd_pcm_substream *substream)
+static int snd_scream_capture_hw_params(struct snd_pcm_substream *substream,
+                                        struct snd_pcm_hw_params *params)
 {
     struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
-    unsigned long flags;
-    struct task_struct *thd = NULL;
+    int ret;
 
-    /* Stop playback first if still running */
-    spin_lock_irqsave(&dev->lock, flags);
-    if (dev->is_running) {
-        dev->is_running = false;
-        thd = dev->playback_thread;
-        dev->playback_thread = NULL;
+    mutex_lock(&dev->cap_mutex);
+    ret = snd_pcm_lib_malloc_pages(substream, params_buffer_bytes(params));
+    mutex_unlock(&dev->cap_mutex);
+    return ret;
+}
+
+static int snd_scream_capture_hw_free(struct snd_pcm_substream *substream)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+    int ret;
+
+    mutex_lock(&dev->cap_mutex);
+    ret = snd_pcm_lib_free_pages(substream);
+    mutex_unlock(&dev->cap_mutex);
+    return ret;
+}
+
+static int snd_scream_capture_prepare(struct snd_pcm_substream *substream)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+    struct snd_pcm_runtime *rt = substream->runtime;
+    u64 prefill = div_u64((u64)rt->rate * clamp_t(int, capture_jitter_ms, 0, 1000), 1000);
+
+    mutex_lock(&dev->cap_mutex);
+    dev->cap_rx_frames = 0;
+    dev->cap_period_frames = 0;
+    dev->cap_prefill_frames = min_t(u64, prefill, rt->buffer_size - rt->period_size);
+    dev->cap_off = 0;
+    scream_publish_cap_frames(dev, 0);
+    mutex_unlock(&dev->cap_mutex);
+    return 0;
+}
+
+static int snd_scream_capture_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+
+    trace_scream_trigger(dev->index, cmd);
+    switch (cmd) {
+    case SNDRV_PCM_TRIGGER_START:
+        dev->cap_priming = true;
+        dev->cap_seen = false;
+        atomic_set(&dev->cap_running, 1);
+        queue_work(system_highpri_wq, &dev->cap_work);
+        break;
+    case SNDRV_PCM_TRIGGER_STOP:
+        atomic_set(&dev->cap_running, 0);
+        break;
+    default:
+        return -EINVAL;
     }
-    spin_unlock_irqrestore(&dev->lock, flags);
+    return 0;
+}
+
+static snd_pcm_uframes_t snd_scream_capture_pointer(struct snd_pcm_substream *substream)
+{
+    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
 
-    if (thd) {
-        kthread_stop(thd);
+    return scream_read_cap_frames(dev) % substream->runtime->buffer_size;
+}
+
+static struct snd_pcm_ops snd_scream_capture_ops = {
+    .open = snd_scream_capture_open,
+    .close = snd_scream_capture_close,
+    .ioctl = snd_scream_pcm_ioctl,
+    .hw_params = snd_scream_capture_hw_params,
+    .hw_free = snd_scream_capture_hw_free,
+    .prepare = snd_scream_capture_prepare,
+    .trigger = snd_scream_capture_trigger,
+    .pointer = snd_scream_capture_pointer,
+    .page = snd_scream_pcm_page,
+};
+
+
+/* ------------------------------
+ *      Proc interface
+ * ------------------------------ */
+static void scream_proc_hist(struct snd_info_buffer *buffer, const char *name, const u64 *hist)
+{
+    unsigned int i;
+
+    snd_iprintf(buffer, "%s:", name);
+    for (i = 0; i < SCREAM_HIST_BUCKETS - 1; i++)
+        snd_iprintf(buffer, " <%u:%llu", 1U << i, hist[i]);
+    snd_iprintf(buffer, " >=%u:%llu\n", 1U << i, hist[i]);
+}
+
+static void scream_proc_read(struct snd_info_entry *entry,
+                             struct snd_info_buffer *buffer)
+{
+    struct snd_scream_device *dev = entry->private_data;
+    struct scream_stats *st = &dev->stats;
+    unsigned int i;
+
+    snd_iprintf(buffer, "payload_bytes: %zu\n", dev->payload_size);
+    snd_iprintf(buffer, "dsd_shuffle: %s\n", scream_dsd_impl_names[scream_dsd_impl]);
+    snd_iprintf(buffer, "packets: %llu\n", st->packets);
+    snd_iprintf(buffer, "bytes: %llu\n", st->bytes);
+    snd_iprintf(buffer, "drops: %llu\n", st->drops);
+    snd_iprintf(buffer, "partial_sends: %llu\n", st->partial_sends);
+    snd_iprintf(buffer, "underruns: %llu\n", st->underruns);
+    snd_iprintf(buffer, "reconnects: %lld\n", (long long)atomic64_read(&dev->reconnects));
+    snd_iprintf(buffer, "timeline_resets: %llu\n", st->timeline_resets);
+    snd_iprintf(buffer, "zerocopy_packets: %llu\n", st->zc_packets);
+    snd_iprintf(buffer, "copy_packets: %llu\n", st->copy_packets);
+    snd_iprintf(buffer, "gso_sends: %llu%s\n", st->gso_sends, dev->udp_gso ? "" : " (off)");
+    if (dev->is_tcp)
+        snd_iprintf(buffer, "tcp: corked %llu page_sends %llu pool_busy %llu pool %s\n",
+                    st->tcp_corked, st->tcp_page_sends, st->tcp_pool_busy,
+                    dev->zc_pool[0] ? "on" : "off");
+    snd_iprintf(buffer, "ext_header: %s seq %u\n", dev->ext_on ? "on" : "off", dev->tx_seq);
+    if (dev->fec_n)
+        snd_iprintf(buffer, "fec: group %u parity %u sent %llu\n", dev->fec_n, dev->fec_k, st->fec_sent);
+    if (silence_suppress || st->silence_pkts)
+        snd_iprintf(buffer, "silence: packets %llu bytes_saved %llu\n", st->silence_pkts, st->silence_bytes);
+    if (lz4 || st->lz4_tries)
+        snd_iprintf(buffer, "lz4: %s tries %llu compressed %llu ratio %llu%% ns_per_try %llu backoff %u\n",
+                    dev->lz4_buf ? "on" : "off", st->lz4_tries, st->lz4_packets,
+                    st->lz4_in ? div64_u64(st->lz4_out * 100, st->lz4_in) : 100,
+                    st->lz4_tries ? div64_u64(st->lz4_ns, st->lz4_tries) : 0, dev->lz4_backoff);
+    if (dev->is_tcp && dev->bl_buf)
+        snd_iprintf(buffer, "tcp_backlog: depth %zu/%zu bytes max %llu queued %llu dropped %llu stalls %llu policy %s\n",
+                    dev->bl_len, dev->bl_limit, st->bl_max, st->bl_queued, st->bl_dropped,
+                    st->bl_stalls, scream_backlog_stalls() ? "stall" : "drop");
+    if (dev->engine->policy == SCHED_DEADLINE)
+        snd_iprintf(buffer, "tx_thread: %d deadline runtime %lluns period %lluns%s\n",
+                    (int)(dev->engine - scream_engines), dev->engine->dl_runtime_ns,
+                    dev->engine->dl_period_ns, scream_tx_pinned ? " pinned" : "");
+    else
+        snd_iprintf(buffer, "tx_thread: %d %s%s\n", (int)(dev->engine - scream_engines),
+                    dev->engine->policy == SCHED_FIFO ? "fifo" : "normal",
+                    scream_tx_pinned ? " pinned" : "");
+    if (pacing_spin_us > 0)
+        snd_iprintf(buffer, "pacing: spin %dus\n", pacing_spin_us);
+    else
+        snd_iprintf(buffer, "pacing: sleep\n");
+    snd_iprintf(buffer, "tx_late_ns: avg %llu max %llu\n",
+                st->jit_samples ? div64_u64(st->late_sum_ns, st->jit_samples) : 0ULL,
+                st->late_max_ns);
+    snd_iprintf(buffer, "tx_jitter_ns: avg %llu max %llu samples %llu\n",
+                st->jit_samples ? div64_u64(st->jit_sum_ns, st->jit_samples) : 0ULL,
+                st->jit_max_ns, st->jit_samples);
+    scream_proc_hist(buffer, "send_latency_us", st->send_hist);
+    scream_proc_hist(buffer, "pacing_error_us", st->late_hist);
+    if (feedback)
+        snd_iprintf(buffer, "feedback: fill_us %u trim_ppb %lld reports %llu\n",
+                    dev->fb_fill_us, dev->trim_ppb, dev->fb_reports);
+    else
+        snd_iprintf(buffer, "feedback: off\n");
+    for (i = 0; i < dev->num_dests; i++)
+        snd_iprintf(buffer, "dest%u: %pI4:%u packets %lld errors %lld last_error %d\n",
+                    i, &dev->dests[i].addr.sin_addr.s_addr, ntohs(dev->dests[i].addr.sin_port),
+                    (long long)atomic64_read(&dev->dests[i].packets),
+                    (long long)atomic64_read(&dev->dests[i].errors),
+                    dev->dests[i].last_err);
+    if (dev->num_targets > 1) {
+        snd_iprintf(buffer, "failovers: %lld\n", (long long)atomic64_read(&dev->failovers));
+        mutex_lock(&dev->fo_lock);
+        for (i = 0; i < dev->num_targets; i++)
+            snd_iprintf(buffer, "target%u: %pI4:%u %s fails %u\n", i,
+                        &dev->targets[i].addr.sin_addr.s_addr, ntohs(dev->targets[i].addr.sin_port),
+                        i == dev->fo_active ? "active" : scream_target_states[dev->targets[i].state],
+                        dev->targets[i].fails);
+        mutex_unlock(&dev->fo_lock);
     }
+    if (capture_port > 0)
+        snd_iprintf(buffer, "capture: %s:%d packets %llu bytes %llu overruns %llu mismatches %llu gaps %llu\n",
+                    dev->cap_tcp ? "tcp" : "udp", capture_port + dev->index,
+                    dev->cap_stats.packets, dev->cap_stats.bytes, dev->cap_stats.overruns,
+                    dev->cap_stats.mismatches, dev->cap_stats.gaps);
+}
 
-    /* Send end-of-track marker */
-    if (dev->sock && atomic_read(&dev->connection_state) == STATE_CONNECTED) {
-        scream_send_last_packet(dev);
+/* echo reset > /proc/asound/cardN/stats */
+static void scream_proc_write(struct snd_info_entry *entry,
+                              struct snd_info_buffer *buffer)
+{
+    struct snd_scream_device *dev = entry->private_data;
+    char line[16];
+    unsigned int i;
+
+    while (!snd_info_get_line(buffer, line, sizeof(line))) {
+        if (strcmp(line, "reset"))
+            continue;
+        mutex_lock(&dev->engine->lock);
+        memset(&dev->stats, 0, sizeof(dev->stats));
+        atomic64_set(&dev->reconnects, 0);
+        atomic64_set(&dev->failovers, 0);
+        for (i = 0; i < dev->num_dests; i++) {
+            atomic64_set(&dev->dests[i].packets, 0);
+            atomic64_set(&dev->dests[i].errors, 0);
+            dev->dests[i].last_err = 0;
+        }
+        mutex_unlock(&dev->engine->lock);
+        mutex_lock(&dev->cap_mutex);
+        memset(&dev->cap_stats, 0, sizeof(dev->cap_stats));
+        mutex_unlock(&dev->cap_mutex);
     }
+}
+
+/* ------------------------------
+ *      Live reconfiguration
+ * ------------------------------ */
+/*
+ * Card controls change the destination, transport, payload policy and batch
+ * size of a running stream:
+ *
+ *   amixer -c N cset iface=CARD,name='Scream Destination Address' 192,168,1,20
+ *
+ * Writes are collected for SCREAM_LIVE_SETTLE_MS, so setting address and
+ * port together makes one switch. A new socket (and for TCP, the connection)
+ * is set up first, without live_lock, on scream_live_wq; the swap then
+ * happens under tx_mutex, between two batches. 'Scream Switch Count' goes
+ * up and notifies once a switch is in effect; a failed switch leaves the
+ * stream, and every control, where it was.
+ */
+#define SCREAM_LIVE_SETTLE_MS 50
+
+enum {
+    SCREAM_CTL_ADDR,
+    SCREAM_CTL_PORT,
+    SCREAM_CTL_TRANSPORT,
+    SCREAM_CTL_POLICY,
+    SCREAM_CTL_BATCH,
+    SCREAM_CTL_SEQ,
+};
 
-    /* Keep socket alive for seamless track switching */
-    spin_lock_irqsave(&dev->lock, flags);
-    dev->substream = NULL;
-    spin_unlock_irqrestore(&dev->lock, flags);
-    return 0;
+/* Notify every control that reads differently in a and b */
+static void scream_live_notify(struct snd_scream_device *dev, const struct scream_live_cfg *a,
+                               const struct scream_live_cfg *b)
+{
+    const bool changed[SCREAM_CTL_SEQ] = {
+        [SCREAM_CTL_ADDR] = a->addr.sin_addr.s_addr != b->addr.sin_addr.s_addr,
+        [SCREAM_CTL_PORT] = a->addr.sin_port != b->addr.sin_port,
+        [SCREAM_CTL_TRANSPORT] = a->is_tcp != b->is_tcp,
+        [SCREAM_CTL_POLICY] = a->adaptive != b->adaptive,
+        [SCREAM_CTL_BATCH] = a->batch != b->batch,
+    };
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(changed); i++)
+        if (changed[i] && dev->live_ctls[i])
+            snd_ctl_notify(dev->card, SNDRV_CTL_EVENT_MASK_VALUE, &dev->live_ctls[i]->id);
 }
 
-static int snd_scream_pcm_hw_params(struct snd_pcm_substream *substream, struct snd_pcm_hw_params *params)
+/* Socket for the new target, connected if TCP, before the stream moves */
+static int scream_live_socket(const struct scream_live_cfg *cfg, struct socket **sockp)
 {
-    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
+    struct socket *sock;
     int ret;
-    unsigned int srt;
 
-    ret = snd_pcm_lib_malloc_pages(substream, params_buffer_bytes(params));
+    ret = SCREAM_SOCK_CREATE(AF_INET, cfg->is_tcp ? SOCK_STREAM : SOCK_DGRAM,
+                             cfg->is_tcp ? IPPROTO_TCP : IPPROTO_UDP, &sock);
     if (ret < 0)
         return ret;
+    if (cfg->is_tcp) {
+        scream_tcp_sockopts(sock);
+        set_sock_timeouts(sock, SCREAM_CONNECT_TIMEOUT_MS);
+        ret = kernel_connect(sock, (struct sockaddr *)&cfg->addr, sizeof(cfg->addr), 0);
+        if (ret < 0) {
+            sock_release(sock);
+            return ret;
+        }
+        set_sock_timeouts(sock, 5000);
+    }
+    *sockp = sock;
+    return 0;
+}
 
-    dev->sample_rate = params_rate(params);
-    dev->channels = params_channels(params);
-    dev->format = params_format(params);
+static bool scream_live_same(const struct scream_live_cfg *a, const struct scream_live_cfg *b)
+{
+    return a->addr.sin_addr.s_addr == b->addr.sin_addr.s_addr &&
+           a->addr.sin_port == b->addr.sin_port && a->is_tcp == b->is_tcp &&
+           a->adaptive == b->adaptive && a->batch == b->batch;
+}
 
+static void scream_live_work(struct work_struct *work)
+{
+    struct snd_scream_device *dev = container_of(to_delayed_work(work),
+                                                 struct snd_scream_device, live_work);
+    struct scream_live_cfg cfg, back;
+    struct socket *sock = NULL, *old = NULL;
+    bool was_tcp, moved, need_sock;
+    int ret = 0;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
-#ifdef SNDRV_PCM_FORMAT_DSD_U32_BE
-    dev->is_dsd = (dev->format == SNDRV_PCM_FORMAT_DSD_U32_BE);
-#else
-    dev->is_dsd = false;
-#endif
-#else
-    dev->is_dsd = false;
-#endif
+    mutex_lock(&dev->live_lock);
+    cfg = dev->live;
+    was_tcp = dev->is_tcp;     /* only changed under live_lock */
+    if (!dev->sock)
+        goto applied;   /* nothing open, the next pcm_open starts with cfg */
+    moved = cfg.addr.sin_addr.s_addr != dev->remote_addr.sin_addr.s_addr ||
+            cfg.addr.sin_port != dev->remote_addr.sin_port;
+    need_sock = cfg.is_tcp != was_tcp || (cfg.is_tcp && moved);
+    mutex_unlock(&dev->live_lock);
 
-    /* Scream 5-byte header */
-    if (dev->is_dsd) {
-        srt = dev->sample_rate / 2;      /* DSD marker uses sample_rate/2 */
-        dev->network_buffer[1] = 1;      /* DSD marker */
-    } else {
-        srt = dev->sample_rate;
-        dev->network_buffer[1] = 32;     /* 32-bit PCM */
+    /* A connect can take SCREAM_CONNECT_TIMEOUT_MS; controls stay usable meanwhile */
+    if (need_sock)
+        ret = scream_live_socket(&cfg, &sock);
+
+    mutex_lock(&dev->live_lock);
+    if (!scream_live_same(&cfg, &dev->live) || dev->is_tcp != was_tcp) {
+        /* A newer write (already queued) or a new stream got in first */
+        if (dev->is_tcp != was_tcp)
+            queue_delayed_work(scream_live_wq, &dev->live_work, 0);
+        mutex_unlock(&dev->live_lock);
+        if (sock)
+            sock_release(sock);
+        return;
     }
+    if (ret < 0) {
+        pr_warn(DRIVER_NAME ": card %d: cannot switch to %pI4:%u over %s: %d\n", dev->index,
+                &cfg.addr.sin_addr.s_addr, ntohs(cfg.addr.sin_port),
+                cfg.is_tcp ? "tcp" : "udp", ret);
+        /* Nothing of the switch applies; the controls show what still runs */
+        dev->live.addr = dev->remote_addr;
+        dev->live.is_tcp = was_tcp;
+        dev->live.adaptive = dev->adaptive;
+        dev->live.batch = dev->batch_cfg;
+        back = dev->live;
+        mutex_unlock(&dev->live_lock);
+        scream_live_notify(dev, &cfg, &back);
+        return;
+    }
+    if (sock)
+        scream_transport_alloc(dev, cfg.is_tcp);
 
-    dev->network_buffer[0] = (u8)((srt % 44100) ? (0 + (srt / 48000)) : (128 + (srt / 44100)));
-    dev->network_buffer[2] = (u8)dev->channels;
-    dev->network_buffer[3] = ch_mask[dev->channels];
-    dev->network_buffer[4] = 0;
-     {
-         unsigned int frame_bytes = (snd_pcm_format_physical_width(dev->format) / 8) * dev->channels;
-         u64 num = (u64)SCREAM_PAYLOAD_SIZE * 1000000000ULL; /* bytes * 1e9 */
-         do_div(num, (u32)(dev->sample_rate * frame_bytes)); /* -> nanoseconds per 1152 bytes */
-         dev->period_time_ns = ktime_set(0, (unsigned long)num);
-     }
-     
-     dev->alsa_period_bytes = params_period_size(params) * dev->channels * 4;
-     dev->bytes_in_period = 0;
+    /* The engine holds tx_mutex for a whole batch, so this lands between two */
+    mutex_lock(&dev->tx_mutex);
+    if (sock) {
+        cancel_delayed_work_sync(&dev->reconnect_work);
+        old = dev->sock;
+        dev->sock = sock;
+        dev->is_tcp = cfg.is_tcp;
+#ifdef SCREAM_HAVE_UDP_GSO
+        dev->udp_gso = udp_gso && !dev->is_tcp;
+#endif
+        dev->corked = false;
+        dev->fb_len = 0;
+        atomic_set(&dev->reconnect_attempts, 0);
+        scream_set_conn_state(dev, STATE_CONNECTED, 0);
+        atomic64_inc(&dev->conn_gen);       /* backlog restarts on a packet boundary */
+    }
+    dev->remote_addr = cfg.addr;
+    if (cfg.is_tcp != was_tcp)
+        scream_setup_dests(dev);
+    else
+        dev->dests[0].addr = cfg.addr;
+    if (!dev->is_tcp && (sock || moved))
+        scream_setup_multicast(dev);
+    /* Room for FEC parity in an adaptive payload depends on the transport */
+    if (cfg.adaptive != dev->adaptive || cfg.batch != dev->batch_cfg ||
+        (sock && cfg.adaptive && dev->fec_n)) {
+        dev->adaptive = cfg.adaptive;
+        dev->batch_cfg = cfg.batch;
+        if (dev->sample_rate) {
+            scream_stream_layout(dev);
+            dev->fec_fill = 0;
+            if (dev->bl_buf)
+                scream_backlog_reset(dev);
+        }
+    } else if (sock && dev->sample_rate) {
+        scream_zc_pool_fit(dev);   /* now on TCP, the layout is unchanged */
+    }
+    mutex_unlock(&dev->tx_mutex);
 
-    return 0;
+    if (old) {
+        if (was_tcp)
+            kernel_sock_shutdown(old, SHUT_RDWR);
+        sock_release(old);
+    }
+    /* Standbys belong to TCP; a new active receiver takes the active slot */
+    if (cfg.is_tcp != was_tcp) {
+        scream_release_targets(dev);
+        if (cfg.is_tcp) {
+            scream_setup_targets(dev);
+            if (dev->num_targets > 1)
+                schedule_delayed_work(&dev->fo_work, 0);
+        }
+    } else if (cfg.is_tcp && moved) {
+        mutex_lock(&dev->fo_lock);
+        if (dev->num_targets > 1)
+            dev->targets[dev->fo_active].addr = cfg.addr;
+        mutex_unlock(&dev->fo_lock);
+    }
+    pr_info(DRIVER_NAME ": card %d: sending to %pI4:%u over %s\n", dev->index,
+            &cfg.addr.sin_addr.s_addr, ntohs(cfg.addr.sin_port), cfg.is_tcp ? "tcp" : "udp");
+applied:
+    dev->live_seq++;
+    mutex_unlock(&dev->live_lock);
+    if (dev->live_ctls[SCREAM_CTL_SEQ])
+        snd_ctl_notify(dev->card, SNDRV_CTL_EVENT_MASK_VALUE, &dev->live_ctls[SCREAM_CTL_SEQ]->id);
 }
 
-static int snd_scream_pcm_prepare(struct snd_pcm_substream *substream)
+static int scream_ctl_info(struct snd_kcontrol *kc, struct snd_ctl_elem_info *uinfo)
 {
-    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
-    dev->hw_ptr = 0;
-    substream->runtime->start_threshold = substream->runtime->period_size;
-    substream->runtime->stop_threshold = substream->runtime->buffer_size;
+    static const char *const transports[] = { "UDP", "TCP" };
+    static const char *const policies[] = { "Fixed", "Adaptive" };
+
+    switch (kc->private_value) {
+    case SCREAM_CTL_TRANSPORT:
+        return snd_ctl_enum_info(uinfo, 1, ARRAY_SIZE(transports), transports);
+    case SCREAM_CTL_POLICY:
+        return snd_ctl_enum_info(uinfo, 1, ARRAY_SIZE(policies), policies);
+    }
+    uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+    uinfo->count = kc->private_value == SCREAM_CTL_ADDR ? 4 : 1;
+    uinfo->value.integer.min = kc->private_value == SCREAM_CTL_PORT ? 1 : 0;
+    switch (kc->private_value) {
+    case SCREAM_CTL_ADDR:
+        uinfo->value.integer.max = 255;
+        break;
+    case SCREAM_CTL_PORT:
+        uinfo->value.integer.max = 65535;
+        break;
+    case SCREAM_CTL_BATCH:
+        uinfo->value.integer.max = SCREAM_MAX_BATCH;    /* 0 = tx_batch */
+        break;
+    default:
+        uinfo->value.integer.max = INT_MAX;
+    }
     return 0;
 }
 
-static int snd_scream_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+static int scream_ctl_get(struct snd_kcontrol *kc, struct snd_ctl_elem_value *uc)
 {
-    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
-    unsigned long flags;
+    struct snd_scream_device *dev = snd_kcontrol_chip(kc);
+    struct scream_live_cfg cfg;
+    const u8 *ip = (const u8 *)&cfg.addr.sin_addr.s_addr;
+    unsigned int i;
 
-    switch (cmd) {
-    case SNDRV_PCM_TRIGGER_START:
-        spin_lock_irqsave(&dev->lock, flags);
-        if (!dev->is_running) {
-            dev->is_running = true;
-            wake_up_interruptible(&dev->playback_waitq);
-        }
-        spin_unlock_irqrestore(&dev->lock, flags);
+    mutex_lock(&dev->live_lock);
+    scream_live_get_cfg(dev, &cfg);
+    switch (kc->private_value) {
+    case SCREAM_CTL_ADDR:
+        for (i = 0; i < 4; i++)
+            uc->value.integer.value[i] = ip[i];
         break;
-    case SNDRV_PCM_TRIGGER_STOP:
-        spin_lock_irqsave(&dev->lock, flags);
-        if (dev->is_running) {
-            dev->is_running = false;
-        }
-        spin_unlock_irqrestore(&dev->lock, flags);
+    case SCREAM_CTL_PORT:
+        uc->value.integer.value[0] = ntohs(cfg.addr.sin_port);
+        break;
+    case SCREAM_CTL_TRANSPORT:
+        uc->value.enumerated.item[0] = cfg.is_tcp;
+        break;
+    case SCREAM_CTL_POLICY:
+        uc->value.enumerated.item[0] = cfg.adaptive;
+        break;
+    case SCREAM_CTL_BATCH:
+        uc->value.integer.value[0] = cfg.batch;
+        break;
+    case SCREAM_CTL_SEQ:
+        uc->value.integer.value[0] = dev->live_seq & INT_MAX;
         break;
-    default:
-        return -EINVAL;
     }
+    mutex_unlock(&dev->live_lock);
     return 0;
 }
 
-static snd_pcm_uframes_t snd_scream_pcm_pointer(struct snd_pcm_substream *substream)
+static int scream_ctl_put(struct snd_kcontrol *kc, struct snd_ctl_elem_value *uc)
 {
-    size_t frames;
-    unsigned long flags;
-    struct snd_scream_device *dev = snd_pcm_substream_chip(substream);
-    spin_lock_irqsave(&dev->lock, flags);
-    #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
-    frames = READ_ONCE(dev->hw_ptr) / 4 / dev->channels;
-    #else
-    frames = dev->hw_ptr / 4 / dev->channels;
-    #endif
-    spin_unlock_irqrestore(&dev->lock, flags);
-    return frames;
-}
+    struct snd_scream_device *dev = snd_kcontrol_chip(kc);
+    struct scream_live_cfg cfg;
+    u8 *ip = (u8 *)&cfg.addr.sin_addr.s_addr;
+    long *v = uc->value.integer.value;
+    unsigned int *item = uc->value.enumerated.item;
+    bool changed = false;
+    unsigned int i;
 
-/* ioctl: forward to helper to avoid crashes */
-static int snd_scream_pcm_ioctl(struct snd_pcm_substream *substream, unsigned int cmd, void *arg)
-{
-    return snd_pcm_lib_ioctl(substream, cmd, arg);
+    switch (kc->private_value) {
+    case SCREAM_CTL_ADDR:
+        for (i = 0; i < 4; i++)
+            if (v[i] < 0 || v[i] > 255)
+                return -EINVAL;
+        break;
+    case SCREAM_CTL_PORT:
+        if (v[0] < 1 || v[0] > 65535)
+            return -EINVAL;
+        break;
+    case SCREAM_CTL_TRANSPORT:
+    case SCREAM_CTL_POLICY:
+        if (item[0] > 1)
+            return -EINVAL;
+        break;
+    case SCREAM_CTL_BATCH:
+        if (v[0] < 0 || v[0] > SCREAM_MAX_BATCH)
+            return -EINVAL;
+        break;
+    default:
+        return -EPERM;
+    }
+
+    mutex_lock(&dev->live_lock);
+    scream_live_get_cfg(dev, &cfg);
+    switch (kc->private_value) {
+    case SCREAM_CTL_ADDR:
+        for (i = 0; i < 4; i++) {
+            changed |= ip[i] != v[i];
+            ip[i] = v[i];
+        }
+        break;
+    case SCREAM_CTL_PORT:
+        changed = ntohs(cfg.addr.sin_port) != v[0];
+        cfg.addr.sin_port = htons(v[0]);
+        break;
+    case SCREAM_CTL_TRANSPORT:
+        changed = cfg.is_tcp != !!item[0];
+        cfg.is_tcp = item[0];
+        break;
+    case SCREAM_CTL_POLICY:
+        changed = cfg.adaptive != !!item[0];
+        cfg.adaptive = item[0];
+        break;
+    case SCREAM_CTL_BATCH:
+        changed = cfg.batch != v[0];
+        cfg.batch = v[0];
+        break;
+    }
+    if (changed) {
+        dev->live = cfg;
+        dev->live_set = true;
+        mod_delayed_work(scream_live_wq, &dev->live_work, msecs_to_jiffies(SCREAM_LIVE_SETTLE_MS));
+    }
+    mutex_unlock(&dev->live_lock);
+    return changed;
 }
 
-/* .page: works for both vmalloc/kmalloc */
-static struct page *snd_scream_pcm_page(struct snd_pcm_substream *substream, unsigned long offset)
+static void scream_ctl_init(struct snd_scream_device *dev)
 {
-    void *addr = substream->runtime->dma_area + offset;
-    return is_vmalloc_addr(addr) ? vmalloc_to_page(addr) : virt_to_page(addr);
+    static const char *const names[] = {
+        [SCREAM_CTL_ADDR] = "Scream Destination Address",
+        [SCREAM_CTL_PORT] = "Scream Destination Port",
+        [SCREAM_CTL_TRANSPORT] = "Scream Transport",
+        [SCREAM_CTL_POLICY] = "Scream Payload Policy",
+        [SCREAM_CTL_BATCH] = "Scream Batch",
+        [SCREAM_CTL_SEQ] = "Scream Switch Count",
+    };
+    unsigned int i;
+    int ret;
+
+    BUILD_BUG_ON(ARRAY_SIZE(names) != ARRAY_SIZE(dev->live_ctls));
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        struct snd_kcontrol_new tmpl = {
+            .iface = SNDRV_CTL_ELEM_IFACE_CARD,
+            .name = names[i],
+            .access = i == SCREAM_CTL_SEQ ?
+                      SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE :
+                      SNDRV_CTL_ELEM_ACCESS_READWRITE,
+            .info = scream_ctl_info,
+            .get = scream_ctl_get,
+            .put = scream_ctl_put,
+            .private_value = i,
+        };
+        struct snd_kcontrol *kc = snd_ctl_new1(&tmpl, dev);
+
+        ret = snd_ctl_add(dev->card, kc);   /* frees kc on failure */
+        if (ret < 0) {
+            pr_warn(DRIVER_NAME ": card %d: cannot add control '%s': %d\n", dev->index, names[i], ret);
+            continue;
+        }
+        dev->live_ctls[i] = kc;
+    }
 }
-/*
-static int scream_pcm_copy(struct snd_pcm_substream *sub, int channel,
-snd_pcm_uframes_t pos, void __user *src,
-snd_pcm_uframes_t frames)
+
+static void scream_proc_init(struct snd_scream_device *dev)
 {
-    struct snd_pcm_runtime *rt = sub->runtime;
-    size_t bytes = frames_to_bytes(rt, frames);
-    size_t off = frames_to_bytes(rt, pos);
-    void *dst = rt->dma_area + off;
-    if (copy_from_user(dst, src, bytes))
-    return -EFAULT;
-    return 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+    snd_card_rw_proc_new(dev->card, "stats", dev, scream_proc_read, scream_proc_write);
+#else
+    struct snd_info_entry *entry;
+
+    if (!snd_card_proc_new(dev->card, "stats", &entry)) {
+        snd_info_set_text_ops(entry, dev, scream_proc_read);
+        entry->c.text.write = scream_proc_write;
+        entry->mode |= S_IWUSR;
+    }
+#endif
 }
 
-static int scream_pcm_silence(struct snd_pcm_substream *sub, int channel,
-snd_pcm_uframes_t pos, snd_pcm_uframes_t frames)
+static void scream_card_free(struct snd_card *card)
 {
-    struct snd_pcm_runtime *rt = sub->runtime;
-    memset(rt->dma_area + frames_to_bytes(rt, pos), 0, frames_to_bytes(rt, frames));
-    return 0;
-}
-*/
-static struct snd_pcm_ops snd_scream_pcm_ops = {
-    .open = snd_scream_pcm_open,
-    .close = snd_scream_pcm_close,
-    .ioctl = snd_scream_pcm_ioctl,
-    .hw_params = snd_scream_pcm_hw_params,
-    .hw_free = snd_pcm_lib_free_pages,
-    .prepare = snd_scream_pcm_prepare,
-    .trigger = snd_scream_pcm_trigger,
-    .pointer = snd_scream_pcm_pointer,
-    .page = snd_scream_pcm_page,
-//    .copy = scream_pcm_copy,
-//    .silence = scream_pcm_silence,
-};
+    struct snd_scream_device *dev = card->private_data;
 
+    if (dev) {
+        /* Stops playback, leaves the engine and closes the socket */
+        scream_cleanup_resources(dev);
+        scream_cap_teardown(dev);
+        scream_zc_pool_free(dev);
+        vfree(dev->bl_buf);
+        vfree(dev->fec_buf);
+        vfree(dev->lz4_buf);
+        vfree(dev->lz4_wrk);
+        vfree(dev->cap_scratch);
+        vfree(dev->last_buffer);
+        vfree(dev->network_buffer);
+        kfree(dev);
+    }
+    snd_card_free(card);
+}
 
-static int __init alsa_scream_driver_init(void)
+static int scream_card_create(int idx)
 {
     int ret;
     struct snd_card *card;
     struct snd_scream_device *dev;
     struct snd_pcm *pcm;
 
-    /* Register a dummy platform device to provide a valid parent struct device */
-    scream_pdev = platform_device_register_simple("screamalsa", -1, NULL, 0);
-    if (IS_ERR(scream_pdev))
-        return PTR_ERR(scream_pdev);
-
     ret = snd_card_new(&scream_pdev->dev, -1, DRIVER_NAME, THIS_MODULE, 0, &card);
     if (ret < 0) {
         pr_err(DRIVER_NAME ": Failed to create sound card: %d\n", ret);
-        platform_device_unregister(scream_pdev);
-        scream_pdev = NULL;
         return ret;
     }
     /* Allocate private data separately */
@@ -839,23 +4268,57 @@ static int __init alsa_scream_driver_init(void)
     if (!dev) {
         pr_err(DRIVER_NAME ": Failed to allocate private data\n");
         snd_card_free(card);
-        platform_device_unregister(scream_pdev);
-        scream_pdev = NULL;
+        return -ENOMEM;
+    }
+
+    dev->network_buffer = vzalloc(SCREAM_MAX_BATCH * SCREAM_MAX_PACKET_SIZE);
+    dev->last_buffer = vzalloc(SCREAM_MAX_PACKET_SIZE);
+    if (capture_port > 0)
+        dev->cap_scratch = vzalloc(SCREAM_MAX_PACKET_SIZE);
+    if (!dev->network_buffer || !dev->last_buffer || (capture_port > 0 && !dev->cap_scratch)) {
+        pr_err(DRIVER_NAME ": Failed to allocate tx buffer\n");
+        vfree(dev->cap_scratch);
+        vfree(dev->last_buffer);
+        vfree(dev->network_buffer);
+        kfree(dev);
+        snd_card_free(card);
         return -ENOMEM;
     }
 
     card->private_data = dev;
     strcpy(card->driver, DRIVER_NAME);
-    strcpy(card->shortname, "ScreamALSA (Network)");
+    if (idx)
+        snprintf(card->shortname, sizeof(card->shortname), "ScreamALSA %d (Network)", idx);
+    else
+        strcpy(card->shortname, "ScreamALSA (Network)");
     snprintf(card->longname, sizeof(card->longname), "%s, streaming to %s:%d",
-             card->shortname, ip_addr_str, port);
+             card->shortname, scream_card_ip(idx), scream_card_port(idx));
 
     snd_card_set_dev(card, &scream_pdev->dev);
 
     dev->card = card;
+    dev->index = idx;
+    dev->engine = &scream_engines[idx % scream_num_engines];
+    if (fec_group[idx] > 0 && !scream_fec_port_clash(idx)) {
+        dev->fec_n = min_t(int, fec_group[idx], SCREAM_FEC_MAX_GROUP);
+        dev->fec_k = clamp_t(int, fec_parity[idx], 1, min_t(int, dev->fec_n, SCREAM_FEC_MAX_PARITY));
+        dev->fec_buf = vzalloc(dev->fec_k * SCREAM_FEC_PKT_MAX);
+        if (!dev->fec_buf) {
+            pr_warn(DRIVER_NAME ": card %d: no memory for FEC, sending without it\n", idx);
+            dev->fec_n = 0;
+        }
+    }
+    INIT_LIST_HEAD(&dev->tx_node);
     spin_lock_init(&dev->lock);
-    init_waitqueue_head(&dev->playback_waitq);
+    mutex_init(&dev->tx_mutex);
     INIT_DELAYED_WORK(&dev->reconnect_work, scream_reconnect_work);
+    INIT_DELAYED_WORK(&dev->fo_work, scream_standby_work);
+    mutex_init(&dev->fo_lock);
+    INIT_DELAYED_WORK(&dev->live_work, scream_live_work);
+    mutex_init(&dev->live_lock);
+    INIT_WORK(&dev->cap_work, scream_cap_work);
+    mutex_init(&dev->cap_mutex);
+    atomic_set(&dev->cap_running, 0);
     atomic_set(&dev->connection_state, STATE_DISCONNECTED);
     atomic_set(&dev->reconnect_attempts, 0);
     atomic_set(&dev->closing, 0);
@@ -863,11 +4326,21 @@ static int __init alsa_scream_driver_init(void)
     dev->substream = NULL;
     dev->is_running = false;
     dev->hw_ptr = 0;
-    dev->playback_thread = NULL;
     dev->bytes_in_period = 0;
     dev->alsa_period_bytes = 0;
+    dev->tx_batch = 1;
+    dev->payload_size = SCREAM_PAYLOAD_SIZE;
+    dev->packet_size = SCREAM_PACKET_SIZE;
+    dev->hdr_size = SCREAM_HEADER_SIZE;
+    dev->src_payload_size = SCREAM_PAYLOAD_SIZE;
+    dev->frame_bytes = 8;
+    dev->src_sample_bytes = 4;
+    dev->wire_sample_bytes = 4;
+    atomic64_set(&dev->reconnects, 0);
+    atomic64_set(&dev->conn_gen, 0);
+    atomic64_set(&dev->failovers, 0);
 
-    ret = snd_pcm_new(card, "Scream HQ PCM", 0, 1, 0, &pcm);
+    ret = snd_pcm_new(card, "Scream HQ PCM", 0, 1, capture_port > 0 ? 1 : 0, &pcm);
     if (ret < 0) {
         pr_err(DRIVER_NAME ": Failed to create PCM device: %d\n", ret);
         goto cleanup_dev;
@@ -878,59 +4351,408 @@ static int __init alsa_scream_driver_init(void)
     strcpy(pcm->name, "Scream HQ Virtual Audio");
 
     snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &snd_scream_pcm_ops);
+    if (capture_port > 0)
+        snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &snd_scream_capture_ops);
     snd_pcm_lib_preallocate_pages_for_all(pcm, SCREAM_DMA_TYPE, SCREAM_DMA_DATA, 128 * 1024, 1024 * 1024);
+    scream_proc_init(dev);
+    scream_ctl_init(dev);
     ret = snd_card_register(card);
     if (ret < 0) {
         pr_err(DRIVER_NAME ": Failed to register sound card: %d\n", ret);
         goto cleanup_dev;
     }
 
-    scream_card_ptr = card;
-    pr_info(DRIVER_NAME ": driver loaded successfully.\n");
+    scream_cards[idx] = card;
     return 0;
 
 cleanup_dev:
+    scream_card_free(card);
+    return ret;
+}
+
+/* ------------------------------
+ *      Load-time self-test
+ * ------------------------------ */
+/* The packetization helpers run against a synthetic ring: no sound card,
+ * socket or hardware is involved, so this also works under UML or QEMU. */
+#define SCREAM_ST_RING_FRAMES 1000   /* not a multiple of any payload: every packet wraps differently */
+#define SCREAM_ST_BENCH_PKTS 20000
+
+#define scream_st_expect(cond, fmt, ...) do { \
+        if (!(cond)) { \
+            pr_err(DRIVER_NAME ": selftest: " fmt "\n", ##__VA_ARGS__); \
+            fails++; \
+        } \
+    } while (0)
+
+/* Point dev and rt at a ring of the given format; returns the ring bytes */
+static size_t scream_st_setup(struct snd_scream_device *dev, struct snd_pcm_runtime *rt,
+                              snd_pcm_format_t format, unsigned int channels, unsigned int wire_bytes,
+                              snd_pcm_uframes_t frames)
+{
+    dev->format = format;
+    dev->channels = channels;
+    dev->src_sample_bytes = snd_pcm_format_physical_width(format) / 8;
+    dev->wire_sample_bytes = wire_bytes;
+    dev->needs_convert = wire_bytes != dev->src_sample_bytes || format == SNDRV_PCM_FORMAT_S24_LE ||
+                         format == SNDRV_PCM_FORMAT_FLOAT_LE;
+    dev->frame_bytes = dev->src_sample_bytes * channels;
+    dev->payload_size = rounddown(SCREAM_PAYLOAD_SIZE, wire_bytes * channels);
+    dev->src_payload_size = dev->payload_size / wire_bytes * dev->src_sample_bytes;
+    dev->hdr_size = SCREAM_HEADER_SIZE;
+    rt->frame_bits = dev->frame_bytes * 8;
+    rt->buffer_size = frames;
+    return frames_to_bytes(rt, frames);
+}
+
+/* Copy and map one packet at every frame position of the ring, including
+ * all the ways a payload can straddle the end, and compare with a plain
+ * sample-by-sample widening of the ring. */
+static int scream_st_ring(struct snd_scream_device *dev, struct snd_pcm_runtime *rt,
+                          u8 *pkt, u8 *ref)
+{
+    static const struct {
+        snd_pcm_format_t format;
+        unsigned int channels, wire_bytes;
+    } cases[] = {
+        { SNDRV_PCM_FORMAT_S32_LE, 2, 4 },
+        { SNDRV_PCM_FORMAT_S32_LE, 8, 4 },
+        { SNDRV_PCM_FORMAT_S16_LE, 2, 4 },
+        { SNDRV_PCM_FORMAT_S16_LE, 6, 2 },
+        { SNDRV_PCM_FORMAT_S24_3LE, 2, 4 },
+        { SNDRV_PCM_FORMAT_S24_3LE, 3, 3 },
+    };
+    struct kvec iov[3];
+    unsigned int c, n, nvec, fails = 0;
+    size_t buf, pos, k, sb, wb, off;
+
+    for (c = 0; c < ARRAY_SIZE(cases); c++) {
+        buf = scream_st_setup(dev, rt, cases[c].format, cases[c].channels, cases[c].wire_bytes,
+                              SCREAM_ST_RING_FRAMES);
+        sb = dev->src_sample_bytes;
+        wb = dev->wire_sample_bytes;
+        for (k = 0; k < buf; k++)
+            rt->dma_area[k] = k * 7 + k / 251;
+
+        for (pos = 0; pos < buf; pos += dev->frame_bytes) {
+            for (k = 0; k < dev->payload_size / wb; k++) {
+                memset(ref + k * wb, 0, wb - sb);
+                memcpy(ref + k * wb + wb - sb, rt->dma_area + (pos + k * sb) % buf, sb);
+            }
+            memset(pkt, 0xa5, dev->payload_size + 1);
+            scream_build_payload(dev, rt, pos, pkt);
+            scream_st_expect(!memcmp(pkt, ref, dev->payload_size) && pkt[dev->payload_size] == 0xa5,
+                             "%s x%u: copy at %zu", snd_pcm_format_name(dev->format),
+                             dev->channels, pos);
+            if (fails)
+                return fails;       /* one report per case is enough */
+            if (dev->needs_convert)
+                continue;
+
+            nvec = scream_map_payload(dev, rt, pos, pkt, iov);
+            for (n = 1, off = 0; n < nvec; n++) {
+                if (off + iov[n].iov_len <= dev->payload_size &&
+                    memcmp(iov[n].iov_base, ref + off, iov[n].iov_len))
+                    break;
+                off += iov[n].iov_len;
+            }
+            scream_st_expect(n == nvec && off == dev->payload_size &&
+                             nvec == (pos + dev->payload_size > buf ? 3 : 2),
+                             "%s x%u: map at %zu", snd_pcm_format_name(dev->format),
+                             dev->channels, pos);
+            if (fails)
+                return fails;
+        }
+    }
+    return fails;
+}
+
+/* The two conversions that are more than a byte shuffle, on known samples.
+ * S24_LE keeps the low 24 bits of the container. FLOAT_LE scales by 2^31:
+ * 1.0 and beyond (Inf, and NaN by its sign bit) clip, and anything below
+ * 2^-31, denormals included, becomes 0. Each ring is packed at the start
+ * and across the wrap. */
+static int scream_st_convert(struct snd_scream_device *dev, struct snd_pcm_runtime *rt, u8 *pkt)
+{
+    static const struct scream_st_vec {
+        u32 in, out;
+    } s24[] = {
+        { 0x00000000, 0x00000000 },
+        { 0x00000001, 0x00000100 },
+        { 0x007fffff, 0x7fffff00 },     /* full scale */
+        { 0x00800000, 0x80000000 },
+        { 0xff800000, 0x80000000 },     /* sign-extended container */
+        { 0xffffffff, 0xffffff00 },
+        { 0x12345678, 0x34567800 },     /* top byte ignored */
+    }, flt[] = {
+        { 0x00000000, 0x00000000 },     /* +0.0 */
+        { 0x80000000, 0x00000000 },     /* -0.0 */
+        { 0x3f800000, 0x7fffffff },     /* +1.0 */
+        { 0xbf800000, 0x80000000 },     /* -1.0 */
+        { 0x3f7fffff, 0x7fffff80 },     /* 1 - 2^-24 */
+        { 0xbf7fffff, 0x80000080 },
+        { 0x3f000000, 0x40000000 },     /* 0.5 */
+        { 0xbf400000, 0xa0000000 },     /* -0.75 */
+        { 0x3b800000, 0x00800000 },     /* 2^-8, mantissa unshifted */
+        { 0x30000000, 0x00000001 },     /* 2^-31 */
+        { 0xb0000000, 0xffffffff },     /* -2^-31 */
+        { 0x2f800000, 0x00000000 },     /* 2^-32 */
+        { 0x00000001, 0x00000000 },     /* smallest denormal */
+        { 0x807fffff, 0x00000000 },     /* largest negative denormal */
+        { 0x40000000, 0x7fffffff },     /* 2.0 */
+        { 0x7f800000, 0x7fffffff },     /* +Inf */
+        { 0xff800000, 0x80000000 },     /* -Inf */
+        { 0x7fc00000, 0x7fffffff },     /* NaN */
+        { 0xffc00000, 0x80000000 },     /* -NaN */
+    };
+    static const struct {
+        snd_pcm_format_t format;
+        const struct scream_st_vec *vecs;
+        unsigned int n;
+    } cases[] = {
+        { SNDRV_PCM_FORMAT_S24_LE, s24, ARRAY_SIZE(s24) },
+        { SNDRV_PCM_FORMAT_FLOAT_LE, flt, ARRAY_SIZE(flt) },
+    };
+    unsigned int c, p, fails = 0;
+    size_t buf, pos, samples, k, idx;
+    __le32 v;
+
+    for (c = 0; c < ARRAY_SIZE(cases); c++) {
+        buf = scream_st_setup(dev, rt, cases[c].format, 2, 4, SCREAM_ST_RING_FRAMES);
+        samples = buf / 4;
+        for (k = 0; k < samples; k++) {
+            v = cpu_to_le32(cases[c].vecs[k % cases[c].n].in);
+            memcpy(rt->dma_area + k * 4, &v, 4);
+        }
+        for (p = 0; p < 2; p++) {
+            pos = p ? buf - 3 * dev->frame_bytes : 0;
+            memset(pkt, 0xa5, dev->payload_size + 1);
+            scream_build_payload(dev, rt, pos, pkt);
+            for (k = 0; k < dev->payload_size / 4; k++) {
+                idx = (pos / 4 + k) % samples % cases[c].n;
+                memcpy(&v, pkt + k * 4, 4);
+                scream_st_expect(le32_to_cpu(v) == cases[c].vecs[idx].out,
+                                 "%s 0x%08x gives 0x%08x, not 0x%08x",
+                                 snd_pcm_format_name(cases[c].format), cases[c].vecs[idx].in,
+                                 le32_to_cpu(v), cases[c].vecs[idx].out);
+                if (fails)
+                    return fails;
+            }
+            scream_st_expect(pkt[dev->payload_size] == 0xa5, "%s: payload overrun at %zu",
+                             snd_pcm_format_name(cases[c].format), pos);
+        }
+    }
+    return fails;
+}
+
+static int scream_st_dsd(u8 *a, u8 *b)
+{
+    static const u8 order[8] = { 0, 4, 1, 5, 2, 6, 3, 7 };
+    unsigned int fails = 0, i;
+    int groups;
+
+    for (i = 0; i < 16; i++)
+        a[i] = i;
+    convert_data((char *)a, 2);
+    for (i = 0; i < 16; i++)
+        scream_st_expect(a[i] == (i & ~7u) + order[i & 7], "DSD shuffle byte %u is %u", i, a[i]);
+
+    /* Every tail length around the SIMD block size */
+    for (groups = 0; groups <= 80; groups++) {
+        get_random_bytes(a, groups * 8);
+        memcpy(b, a, groups * 8);
+        convert_data((char *)a, groups);
+        scream_convert_dsd((char *)b, groups);
+        scream_st_expect(!memcmp(a, b, groups * 8), "%s DSD shuffle, %d groups",
+                         scream_dsd_impl_names[scream_dsd_impl], groups);
+    }
+    return fails;
+}
+
+static int scream_st_header(void)
+{
+    static const struct {
+        unsigned int rate;
+        bool is_dsd;
+        u8 byte;
+    } rates[] = {
+        { 44100, false, 0x81 }, { 48000, false, 0x01 }, { 88200, false, 0x82 },
+        { 96000, false, 0x02 }, { 176400, false, 0x84 }, { 192000, false, 0x04 },
+        { 352800, false, 0x88 }, { 384000, false, 0x08 }, { 768000, false, 0x10 },
+        { 88200, true, 0x81 }, { 176400, true, 0x82 }, { 705600, true, 0x88 },
+    };
+    static const struct {
+        size_t payload;
+        unsigned int rate, frame_bytes;
+        s64 ns;
+    } times[] = {
+        { 1152, 48000, 8, 3000000 },
+        { 1152, 44100, 8, 3265306 },
+        { 1152, 44100, 4, 6530612 },
+        { 1152, 88200, 8, 1632653 },            /* DSD64 */
+        { 1152, 768000, 32, 46875 },
+        { 1464, 48000, 6, 5083333 },            /* adaptive, 1500 MTU, native S24_3LE stereo */
+    };
+    unsigned int fails = 0, i;
+    s64 ns;
+
+    for (i = 0; i < ARRAY_SIZE(rates); i++)
+        scream_st_expect(scream_rate_byte(rates[i].rate, rates[i].is_dsd) == rates[i].byte,
+                         "rate byte for %u%s is 0x%02x", rates[i].rate, rates[i].is_dsd ? " DSD" : "",
+                         scream_rate_byte(rates[i].rate, rates[i].is_dsd));
+    for (i = 0; i < ARRAY_SIZE(times); i++) {
+        ns = ktime_to_ns(scream_packet_time(times[i].payload, times[i].rate, times[i].frame_bytes));
+        scream_st_expect(ns == times[i].ns, "%zu bytes at %u Hz x %u: %lld ns",
+                         times[i].payload, times[i].rate, times[i].frame_bytes, (long long)ns);
+    }
+    return fails;
+}
+
+/* ns per 1152-byte packet for the copy path, as the engine runs it */
+static void scream_st_bench(struct snd_scream_device *dev, struct snd_pcm_runtime *rt, u8 *pkt)
+{
+    static const struct {
+        snd_pcm_format_t format;
+        bool is_dsd;
+    } fmts[] = {
+        { SNDRV_PCM_FORMAT_S16_LE, false },
+        { SNDRV_PCM_FORMAT_S24_3LE, false },
+        { SNDRV_PCM_FORMAT_S24_LE, false },
+        { SNDRV_PCM_FORMAT_S32_LE, false },
+        { SNDRV_PCM_FORMAT_FLOAT_LE, false },
+        { SNDRV_PCM_FORMAT_S32_LE, true },      /* DSD_U32_BE has the same layout */
+    };
+    static const unsigned int chans[] = { 2, 8 };
+    unsigned int f, c, i;
+    size_t buf, pos;
+    ktime_t t0;
+    s64 ns;
+
+    for (f = 0; f < ARRAY_SIZE(fmts); f++) {
+        for (c = 0; c < ARRAY_SIZE(chans); c++) {
+            buf = scream_st_setup(dev, rt, fmts[f].format, chans[c], 4, 16384);
+            pos = 0;
+            t0 = ktime_get();
+            for (i = 0; i < SCREAM_ST_BENCH_PKTS; i++) {
+                scream_build_payload(dev, rt, pos, pkt);
+                if (fmts[f].is_dsd)
+                    scream_convert_dsd((char *)pkt, dev->payload_size / 8);
+                pos = (pos + dev->src_payload_size) % buf;
+            }
+            ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+            pr_info(DRIVER_NAME ": selftest: %s x%u: %lld ns/packet\n",
+                    fmts[f].is_dsd ? "DSD" : snd_pcm_format_name(fmts[f].format), chans[c],
+                    div_s64(ns, SCREAM_ST_BENCH_PKTS));
+            cond_resched();
+        }
+    }
+}
+
+static int scream_selftest(void)
+{
+    struct snd_scream_device *dev;
+    struct snd_pcm_runtime *rt;
+    u8 *pkt, *ref;
+    int fails = -ENOMEM;
+
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    rt = kzalloc(sizeof(*rt), GFP_KERNEL);
+    pkt = kmalloc(SCREAM_MAX_PACKET_SIZE, GFP_KERNEL);
+    ref = kmalloc(SCREAM_MAX_PACKET_SIZE, GFP_KERNEL);
+    if (rt)
+        rt->dma_area = vmalloc(16384 * 8 * 4);
+    if (!dev || !rt || !pkt || !ref || !rt->dma_area)
+        goto out;
+
+    fails = scream_st_header();
+    fails += scream_st_dsd(pkt, ref);
+    fails += scream_st_ring(dev, rt, pkt, ref);
+    fails += scream_st_convert(dev, rt, pkt);
+    if (fails) {
+        pr_err(DRIVER_NAME ": selftest: %d check(s) failed\n", fails);
+        fails = -EINVAL;
+        goto out;
+    }
+    pr_info(DRIVER_NAME ": selftest: packetization checks passed\n");
+    if (selftest >= 2)
+        scream_st_bench(dev, rt, pkt);
+out:
+    if (rt)
+        vfree(rt->dma_area);
+    kfree(ref);
+    kfree(pkt);
+    kfree(rt);
     kfree(dev);
-    snd_card_free(card);
+    return fails;
+}
+
+static int __init alsa_scream_driver_init(void)
+{
+    int ret, i;
+
+    scream_dsd_select();
+    if (selftest > 0) {
+        ret = scream_selftest();
+        if (ret < 0)
+            return ret;
+    }
+
+    scream_live_wq = alloc_workqueue("scream_live", WQ_UNBOUND, 0);
+    if (!scream_live_wq)
+        return -ENOMEM;
+
+    /* Register a dummy platform device to provide a valid parent struct device */
+    scream_pdev = platform_device_register_simple("screamalsa", -1, NULL, 0);
+    if (IS_ERR(scream_pdev)) {
+        ret = PTR_ERR(scream_pdev);
+        goto cleanup_wq;
+    }
+
+    ret = scream_tx_engines_start();
+    if (ret < 0)
+        goto cleanup_pdev;
+
+    scream_num_cards = clamp_t(int, cards, 1, SCREAM_MAX_CARDS);
+    for (i = 0; i < scream_num_cards; i++) {
+        ret = scream_card_create(i);
+        if (ret < 0)
+            goto cleanup_cards;
+    }
+
+    pr_info(DRIVER_NAME ": driver loaded successfully (%d card(s), %d tx thread(s)).\n",
+            scream_num_cards, scream_num_engines);
+    return 0;
+
+cleanup_cards:
+    while (--i >= 0) {
+        scream_card_free(scream_cards[i]);
+        scream_cards[i] = NULL;
+    }
+    scream_tx_engines_stop();
+cleanup_pdev:
     platform_device_unregister(scream_pdev);
     scream_pdev = NULL;
+cleanup_wq:
+    destroy_workqueue(scream_live_wq);
     return ret;
 }
 
 static void __exit alsa_scream_driver_exit(void)
 {
-    if (scream_card_ptr) {
-        struct snd_scream_device *dev = scream_card_ptr->private_data;
-
-        if (dev) {
-            /* Stop playback first if running */
-            unsigned long flags;
-            struct task_struct *thd = NULL;
-            spin_lock_irqsave(&dev->lock, flags);
-            if (dev->is_running) {
-                dev->is_running = false;
-                thd = dev->playback_thread;
-                dev->playback_thread = NULL;
-            }
-            spin_unlock_irqrestore(&dev->lock, flags);
-            
-            if (thd) {
-                kthread_stop(thd);
-            }
-            
-            cancel_delayed_work_sync(&dev->reconnect_work);
+    int i;
 
-            scream_cleanup_resources(dev);
-            kfree(dev);
+    for (i = 0; i < scream_num_cards; i++) {
+        if (scream_cards[i]) {
+            scream_card_free(scream_cards[i]);
+            scream_cards[i] = NULL;
         }
-
-        snd_card_free(scream_card_ptr);
-        scream_card_ptr = NULL;
     }
+    scream_tx_engines_stop();
     if (scream_pdev) {
         platform_device_unregister(scream_pdev);
         scream_pdev = NULL;
     }
+    destroy_workqueue(scream_live_wq);
     pr_info(DRIVER_NAME ": driver unloaded.\n");
 }
 
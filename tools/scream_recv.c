@@ -0,0 +1,1098 @@
+/*
+ * scream_recv - reference receiver and stream analyzer for ScreamALSA
+ *
+ * Receives a Scream stream over UDP (batched with recvmmsg) or TCP and
+ * reports throughput, packet rate, inter-arrival jitter, gaps and drift
+ * against the nominal sample rate. Optionally writes the audio to a WAV
+ * file (PCM) or a DSF file (DSD), asks the sender for the extended header,
+ * repairs losses from FEC parity and sends buffer-fill feedback from a
+ * simulated playout clock.
+ *
+ *   scream_recv [-t] [-p port] [-g group] [-w file.wav] [-d file.dsf] ...
+ *
+ * License: GPL-2
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../scream_proto.h"
+#include "../scream_fec.h"
+
+#define DEFAULT_PORT        4011
+#define LEGACY_PAYLOAD      1152
+#define MAX_PACKET          9216
+#define BATCH               64
+#define HIST_BUCKETS        16
+#define FEC_WINDOW          64      /* packets held back for repair */
+
+struct fmt {
+    unsigned int rate;              /* PCM sample rate, or DSD bit rate */
+    unsigned int bits;              /* 1 = DSD */
+    unsigned int channels;
+    unsigned int mask;
+};
+
+struct stats {
+    uint64_t packets, bytes, frames;
+    uint64_t gaps, lost, reordered, dups;
+    uint64_t fec_parity, fec_repaired, fec_late, fec_ambiguous;
+    uint64_t tracks, bad;
+    uint64_t silent_frames;             /* carried by silence markers */
+    uint64_t lz4_packets;               /* compressed packets */
+    uint64_t lz4_raw, lz4_wire;         /* their payload bytes, decoded and as sent */
+    uint64_t iat_hist[HIST_BUCKETS];    /* inter-arrival time, log2 us */
+    uint64_t dev_hist[HIST_BUCKETS];    /* |arrival - timeline|, log2 us */
+    uint64_t lat_n;
+    int64_t lat_sum, lat_min, lat_max;  /* one-way, extended header only */
+};
+
+struct pkt {
+    uint8_t data[MAX_PACKET];
+    size_t len;
+    uint32_t hash;
+};
+
+static struct {
+    /* options */
+    bool tcp, ask_ext, use_fec, quiet;
+    int port, fec_port, interval, gap_ms, feedback_ms;
+    size_t tcp_payload;
+    const char *group, *wav_path, *dsf_path;
+
+    /* sockets */
+    int fd, fec_fd, conn;
+    struct sockaddr_in peer;
+    bool have_peer;
+
+    /* stream */
+    struct fmt fmt;
+    bool have_fmt;
+    uint64_t t0_ns, last_ns, stream_frames;
+    double fit_n, fit_t, fit_f, fit_tt, fit_tf;    /* frames against arrival time */
+    bool have_seq;
+    uint32_t next_seq;
+
+    struct stats total, win;
+    uint64_t win_start_ns;
+
+    /* FEC window, oldest first */
+    struct pkt *fec[FEC_WINDOW];
+    unsigned int fec_len;
+    struct pkt *pool[FEC_WINDOW + 1];
+    unsigned int pool_len;
+
+    /* output */
+    FILE *out;
+    unsigned int out_index;
+    uint64_t out_bytes;
+    uint8_t *dsf_block;             /* channels x 4096 */
+    unsigned int dsf_fill;
+    uint64_t dsf_samples;
+} rx = {
+    .port = DEFAULT_PORT,
+    .interval = 1,
+    .gap_ms = 20,
+    .tcp_payload = LEGACY_PAYLOAD,
+    .fd = -1,
+    .fec_fd = -1,
+    .conn = -1,
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void hist_add(uint64_t *hist, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    unsigned int b = 0;
+
+    while (us && b < HIST_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    hist[b]++;
+}
+
+static void hist_print(const char *name, const uint64_t *hist)
+{
+    unsigned int b;
+
+    printf("  %s:", name);
+    for (b = 0; b < HIST_BUCKETS; b++)
+        if (hist[b])
+            printf(" <%uus:%" PRIu64, 1u << b, hist[b]);
+    printf("\n");
+}
+
+/* ------------------------------
+ *      Output files
+ * ------------------------------ */
+static void put_le(uint8_t *p, uint64_t v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        p[i] = v >> (8 * i);
+}
+
+static void wav_header(uint8_t *h, const struct fmt *f, uint64_t data_bytes)
+{
+    unsigned int block = f->bits / 8 * f->channels;
+    bool ext = f->channels > 2 || f->bits > 16;
+    uint32_t data = data_bytes > 0xffffffffull - 68 ? 0xffffffffu - 68 : data_bytes;
+    static const uint8_t pcm_guid[16] = {
+        0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+        0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71,
+    };
+
+    /* The header is always 68 bytes; plain PCM pads with a JUNK chunk */
+    memcpy(h, "RIFF", 4);
+    put_le(h + 4, 60 + data, 4);
+    memcpy(h + 8, "WAVE", 4);
+    if (!ext) {
+        memcpy(h + 12, "JUNK", 4);
+        put_le(h + 16, 16, 4);
+        memset(h + 20, 0, 16);
+        h += 24;
+    }
+    memcpy(h + 12, "fmt ", 4);
+    put_le(h + 16, ext ? 40 : 16, 4);
+    put_le(h + 20, ext ? 0xfffe : 1, 2);
+    put_le(h + 22, f->channels, 2);
+    put_le(h + 24, f->rate, 4);
+    put_le(h + 28, (uint64_t)f->rate * block, 4);
+    put_le(h + 32, block, 2);
+    put_le(h + 34, f->bits, 2);
+    if (!ext) {
+        memcpy(h + 36, "data", 4);
+        put_le(h + 40, data, 4);
+        return;
+    }
+    put_le(h + 36, 22, 2);
+    put_le(h + 38, f->bits, 2);
+    put_le(h + 40, f->mask, 4);
+    memcpy(h + 44, pcm_guid, 16);
+    memcpy(h + 60, "data", 4);
+    put_le(h + 64, data, 4);
+}
+
+#define WAV_HEADER_SIZE 68
+#define DSF_HEADER_SIZE 92
+#define DSF_BLOCK 4096
+
+static void dsf_header(uint8_t *h, const struct fmt *f, uint64_t data_bytes, uint64_t samples)
+{
+    /* DSF channel type by count: mono, stereo, 3ch, quad, 5ch, 5.1 */
+    static const unsigned int chan_type[] = { 0, 1, 2, 3, 4, 6, 7 };
+
+    memcpy(h, "DSD ", 4);
+    put_le(h + 4, 28, 8);
+    put_le(h + 12, DSF_HEADER_SIZE + data_bytes, 8);
+    put_le(h + 20, 0, 8);                   /* no metadata */
+    memcpy(h + 28, "fmt ", 4);
+    put_le(h + 32, 52, 8);
+    put_le(h + 40, 1, 4);                   /* version */
+    put_le(h + 44, 0, 4);                   /* DSD raw */
+    put_le(h + 48, f->channels < 7 ? chan_type[f->channels] : 0, 4);
+    put_le(h + 52, f->channels, 4);
+    put_le(h + 56, f->rate, 4);
+    put_le(h + 60, 1, 4);                   /* bits per sample, LSB first */
+    put_le(h + 64, samples, 8);
+    put_le(h + 72, DSF_BLOCK, 4);
+    put_le(h + 76, 0, 4);
+    memcpy(h + 80, "data", 4);
+    put_le(h + 84, 12 + data_bytes, 8);
+}
+
+static void dsf_flush_block(void)
+{
+    if (!rx.dsf_fill)
+        return;
+    /* A short last block is zero padded, as the format asks */
+    fwrite(rx.dsf_block, 1, (size_t)DSF_BLOCK * rx.fmt.channels, rx.out);
+    rx.out_bytes += (size_t)DSF_BLOCK * rx.fmt.channels;
+    memset(rx.dsf_block, 0, (size_t)DSF_BLOCK * rx.fmt.channels);
+    rx.dsf_fill = 0;
+}
+
+static void out_close(void)
+{
+    uint8_t h[DSF_HEADER_SIZE];
+
+    if (!rx.out)
+        return;
+    if (rx.fmt.bits == 1) {
+        dsf_flush_block();
+        dsf_header(h, &rx.fmt, rx.out_bytes, rx.dsf_samples);
+    } else {
+        wav_header(h, &rx.fmt, rx.out_bytes);
+    }
+    rewind(rx.out);
+    fwrite(h, 1, rx.fmt.bits == 1 ? DSF_HEADER_SIZE : WAV_HEADER_SIZE, rx.out);
+    fclose(rx.out);
+    rx.out = NULL;
+    free(rx.dsf_block);
+    rx.dsf_block = NULL;
+}
+
+/* A format change starts a new file: name.wav, name.1.wav, ... */
+static void out_open(void)
+{
+    const char *path = rx.fmt.bits == 1 ? rx.dsf_path : rx.wav_path;
+    uint8_t h[DSF_HEADER_SIZE] = { 0 };
+    char name[4096];
+    const char *dot;
+
+    out_close();
+    if (!path)
+        return;
+    if (rx.out_index++) {
+        dot = strrchr(path, '.');
+        snprintf(name, sizeof(name), "%.*s.%u%s", dot ? (int)(dot - path) : (int)strlen(path), path,
+                 rx.out_index - 1, dot ? dot : "");
+        path = name;
+    }
+    rx.out = fopen(path, "wb");
+    if (!rx.out) {
+        perror(path);
+        return;
+    }
+    rx.out_bytes = 0;
+    rx.dsf_samples = 0;
+    rx.dsf_fill = 0;
+    if (rx.fmt.bits == 1)
+        rx.dsf_block = calloc(rx.fmt.channels, DSF_BLOCK);
+    fwrite(h, 1, rx.fmt.bits == 1 ? DSF_HEADER_SIZE : WAV_HEADER_SIZE, rx.out);
+    if (!rx.quiet)
+        printf("writing %s\n", path);
+}
+
+static uint8_t bitrev(uint8_t b)
+{
+    b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+    b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+    return (b & 0xaa) >> 1 | (b & 0x55) << 1;
+}
+
+/*
+ * The driver sends DSD_U32_BE frames with each 8-byte group (4 bytes of
+ * two neighbouring channels) byte-interleaved; DSF wants LSB-first bytes
+ * in 4096-byte blocks per channel.
+ */
+static void dsf_write(const uint8_t *p, size_t len)
+{
+    unsigned int ch = rx.fmt.channels, pairs = ch / 2;
+    size_t frame = 4 * (size_t)ch, f, t, c;
+
+    if (!rx.dsf_block || ch % 2)
+        return;
+    for (f = 0; f + frame <= len; f += frame) {
+        for (t = 0; t < 4; t++) {
+            for (c = 0; c < pairs; c++) {
+                const uint8_t *g = p + f + 8 * c;
+
+                rx.dsf_block[(2 * c) * DSF_BLOCK + rx.dsf_fill] = bitrev(g[2 * t]);
+                rx.dsf_block[(2 * c + 1) * DSF_BLOCK + rx.dsf_fill] = bitrev(g[2 * t + 1]);
+            }
+            rx.dsf_samples += 8;
+            if (++rx.dsf_fill == DSF_BLOCK)
+                dsf_flush_block();
+        }
+    }
+}
+
+static void out_write(const uint8_t *p, size_t len)
+{
+    if (!rx.out)
+        return;
+    if (rx.fmt.bits == 1) {
+        dsf_write(p, len);
+        return;
+    }
+    fwrite(p, 1, len, rx.out);
+    rx.out_bytes += len;
+}
+
+static void out_silence(uint64_t frames, unsigned int fb)
+{
+    static uint8_t zero[4096], idle[4096];
+    const uint8_t *fill = zero;
+    uint64_t bytes = frames * fb;
+    size_t n, chunk = sizeof(zero) / fb * fb;   /* whole frames, for dsf_write */
+
+    if (!rx.out)
+        return;
+    if (rx.fmt.bits == 1) {
+        if (!idle[0])
+            memset(idle, SCREAM_DSD_IDLE, sizeof(idle));
+        fill = idle;
+    }
+    for (; bytes; bytes -= n) {
+        n = bytes < chunk ? bytes : chunk;
+        out_write(fill, n);
+    }
+}
+
+/* ------------------------------
+ *      Stream analysis
+ * ------------------------------ */
+static void decode_fmt(const uint8_t *h, struct fmt *f)
+{
+    unsigned int base = (h[0] & 0x80) ? 44100 * (h[0] & 0x7f) : 48000 * h[0];
+
+    f->bits = h[1];
+    f->channels = h[2];
+    f->mask = h[3];
+    /* DSD: the header carries a quarter of the ALSA DSD_U32 rate; x64 is the bit rate */
+    f->rate = f->bits == 1 ? base * 64 : base;
+}
+
+static unsigned int frame_bytes(const struct fmt *f)
+{
+    return f->bits == 1 ? 4 * f->channels : f->bits / 8 * f->channels;
+}
+
+/* Raw LZ4 block into dst; returns the decoded length or -1 */
+static long lz4_decode(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    const uint8_t *end = src + len;
+    size_t o = 0, lit, mlen, off, k;
+    unsigned int tok, b;
+
+    while (src < end) {
+        tok = *src++;
+        lit = tok >> 4;
+        if (lit == 15) {
+            do {
+                if (src >= end)
+                    return -1;
+                lit += b = *src++;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(end - src) || lit > cap - o)
+            return -1;
+        memcpy(dst + o, src, lit);
+        src += lit;
+        o += lit;
+        if (src == end)
+            break;              /* the last sequence is literals only */
+        if (end - src < 2)
+            return -1;
+        off = src[0] | src[1] << 8;
+        src += 2;
+        mlen = (tok & 15) + 4;
+        if ((tok & 15) == 15) {
+            do {
+                if (src >= end)
+                    return -1;
+                mlen += b = *src++;
+            } while (b == 255);
+        }
+        if (!off || off > o || mlen > cap - o)
+            return -1;
+        for (k = 0; k < mlen; k++, o++)     /* matches may overlap their output */
+            dst[o] = dst[o - off];
+    }
+    return o;
+}
+
+/* Frames a data packet carries; silence markers and compressed packets
+ * say so right after the header */
+static uint64_t packet_frames(const uint8_t *pkt, size_t len, size_t hdr, unsigned int fb)
+{
+    if (pkt[4] & SCREAM_FLAG_SILENCE)
+        return len >= hdr + SCREAM_SILENCE_SIZE ? scream_silence_get(pkt + hdr) : 0;
+    if (pkt[4] & SCREAM_FLAG_LZ4)
+        return len >= hdr + SCREAM_LZ4_LEN_SIZE ? (pkt[hdr] | pkt[hdr + 1] << 8) / fb : 0;
+    return (len - hdr) / fb;
+}
+
+static void stream_reset(void)
+{
+    rx.t0_ns = 0;
+    rx.stream_frames = 0;
+    rx.fit_n = rx.fit_t = rx.fit_f = rx.fit_tt = rx.fit_tf = 0;
+    rx.have_seq = false;
+}
+
+/* Only meaningful when sender and receiver share a clock, e.g. loopback */
+static void account_latency(const struct scream_ext_header *xh, uint64_t t)
+{
+    int64_t lat = (int64_t)(t - xh->time_ns);
+    struct stats *s[2] = { &rx.win, &rx.total };
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (!s[i]->lat_n || lat < s[i]->lat_min)
+            s[i]->lat_min = lat;
+        if (!s[i]->lat_n || lat > s[i]->lat_max)
+            s[i]->lat_max = lat;
+        s[i]->lat_sum += lat;
+        s[i]->lat_n++;
+    }
+}
+
+/* Arrival side: timing only, in arrival order */
+static void account_arrival(const uint8_t *pkt, size_t len, uint64_t t)
+{
+    struct scream_ext_header xh;
+    struct fmt f;
+    unsigned int fb;
+    size_t hdr;
+
+    if (!scream_ext_get(pkt, len, &xh))
+        account_latency(&xh, t);
+    if (len < SCREAM_BASE_HEADER_SIZE || (pkt[4] & SCREAM_FLAG_END))
+        return;
+    decode_fmt(pkt, &f);
+    fb = frame_bytes(&f);
+    hdr = (pkt[4] & SCREAM_FLAG_EXT) ? SCREAM_EXT_HEADER_SIZE : SCREAM_BASE_HEADER_SIZE;
+    if (!fb || !f.rate || len <= hdr)
+        return;
+
+    if (rx.last_ns) {
+        uint64_t d = t - rx.last_ns;
+
+        hist_add(rx.win.iat_hist, d);
+        hist_add(rx.total.iat_hist, d);
+        if (d > (uint64_t)rx.gap_ms * 1000000) {
+            rx.win.gaps++;
+            rx.total.gaps++;
+            stream_reset();     /* the timeline starts over after a pause */
+        }
+    }
+    rx.last_ns = t;
+
+    if (!rx.t0_ns) {
+        rx.t0_ns = t;
+    } else {
+        /* Where this packet should have arrived on the nominal timeline */
+        uint64_t due = rx.t0_ns + rx.stream_frames * 1000000000ull / (f.bits == 1 ? f.rate / 32 : f.rate);
+        uint64_t dev = t > due ? t - due : due - t;
+
+        hist_add(rx.win.dev_hist, dev);
+        hist_add(rx.total.dev_hist, dev);
+    }
+    {
+        double x = (t - rx.t0_ns) / 1e9, y = rx.stream_frames;
+
+        rx.fit_n++;
+        rx.fit_t += x;
+        rx.fit_f += y;
+        rx.fit_tt += x * x;
+        rx.fit_tf += x * y;
+    }
+    rx.stream_frames += packet_frames(pkt, len, hdr, fb);
+}
+
+/* Delivery side: in stream order, after any FEC repair */
+static void deliver(const uint8_t *pkt, size_t len)
+{
+    static uint8_t raw[65536];
+    struct scream_ext_header xh;
+    uint64_t frames;
+    long rawlen = 0;
+    struct fmt f;
+    bool ok;
+    size_t hdr = SCREAM_BASE_HEADER_SIZE;
+    unsigned int fb;
+
+    if (len < SCREAM_BASE_HEADER_SIZE) {
+        rx.total.bad++;
+        return;
+    }
+    if (!scream_ext_get(pkt, len, &xh)) {
+        hdr = SCREAM_EXT_HEADER_SIZE;
+        if (rx.have_seq && xh.seq != rx.next_seq) {
+            int32_t d = (int32_t)(xh.seq - rx.next_seq);
+
+            if (d > 0) {
+                rx.win.lost += d;
+                rx.total.lost += d;
+            } else {
+                rx.win.reordered++;
+                rx.total.reordered++;
+            }
+        }
+        if (!rx.have_seq || (int32_t)(xh.seq - rx.next_seq) >= 0)
+            rx.next_seq = xh.seq + 1;
+        rx.have_seq = true;
+    }
+    if (pkt[4] & SCREAM_FLAG_END) {
+        rx.total.tracks++;
+        if (!rx.quiet)
+            printf("end of track\n");
+        return;
+    }
+
+    decode_fmt(pkt, &f);
+    fb = frame_bytes(&f);
+    if (!fb || !f.rate || len < hdr) {
+        rx.total.bad++;
+        return;
+    }
+    if (pkt[4] & SCREAM_FLAG_SILENCE) {
+        ok = len == hdr + SCREAM_SILENCE_SIZE;
+    } else if (pkt[4] & SCREAM_FLAG_LZ4) {
+        if (len >= hdr + SCREAM_LZ4_LEN_SIZE)
+            rawlen = lz4_decode(pkt + hdr + SCREAM_LZ4_LEN_SIZE, len - hdr - SCREAM_LZ4_LEN_SIZE,
+                                raw, sizeof(raw));
+        ok = rawlen > 0 && rawlen == (pkt[hdr] | pkt[hdr + 1] << 8) && rawlen % fb == 0;
+    } else {
+        ok = (len - hdr) % fb == 0;
+    }
+    if (!ok) {
+        rx.total.bad++;
+        return;
+    }
+    if (!rx.have_fmt || memcmp(&f, &rx.fmt, sizeof(f))) {
+        rx.fmt = f;
+        rx.have_fmt = true;
+        if (!rx.quiet)
+            printf("stream: %u Hz %s%u ch mask 0x%02x\n", f.rate,
+                   f.bits == 1 ? "DSD " : "", f.channels, f.mask);
+        if (f.bits != 1 && !rx.quiet)
+            printf("  %u-bit PCM\n", f.bits);
+        out_open();
+    }
+
+    rx.win.packets++;
+    rx.total.packets++;
+    rx.win.bytes += len;
+    rx.total.bytes += len;
+    frames = packet_frames(pkt, len, hdr, fb);
+    rx.win.frames += frames;
+    rx.total.frames += frames;
+    if (pkt[4] & SCREAM_FLAG_SILENCE) {
+        rx.total.silent_frames += frames;
+        out_silence(frames, fb);
+    } else if (rawlen) {
+        rx.total.lz4_packets++;
+        rx.total.lz4_raw += rawlen;
+        rx.total.lz4_wire += len - hdr;
+        out_write(raw, rawlen);
+    } else {
+        out_write(pkt + hdr, len - hdr);
+    }
+}
+
+/* ------------------------------
+ *      FEC repair
+ * ------------------------------ */
+static struct pkt *pkt_get(void)
+{
+    return rx.pool_len ? rx.pool[--rx.pool_len] : malloc(sizeof(struct pkt));
+}
+
+static void pkt_put(struct pkt *p)
+{
+    if (rx.pool_len < FEC_WINDOW + 1)
+        rx.pool[rx.pool_len++] = p;
+    else
+        free(p);
+}
+
+static void fec_insert(unsigned int at, struct pkt *p)
+{
+    if (rx.fec_len == FEC_WINDOW) {
+        /* Oldest packet has waited long enough */
+        deliver(rx.fec[0]->data, rx.fec[0]->len);
+        pkt_put(rx.fec[0]);
+        memmove(rx.fec, rx.fec + 1, --rx.fec_len * sizeof(rx.fec[0]));
+        if (at)
+            at--;
+    }
+    memmove(rx.fec + at + 1, rx.fec + at, (rx.fec_len - at) * sizeof(rx.fec[0]));
+    rx.fec[at] = p;
+    rx.fec_len++;
+}
+
+static void fec_data(const uint8_t *data, size_t len)
+{
+    struct pkt *p = pkt_get();
+
+    if (!p || len > MAX_PACKET)
+        return;
+    memcpy(p->data, data, len);
+    p->len = len;
+    p->hash = scream_fec_hash(SCREAM_FEC_HASH_INIT, data, len);
+    fec_insert(rx.fec_len, p);
+}
+
+static int fec_find(uint32_t hash)
+{
+    int i;
+
+    for (i = (int)rx.fec_len - 1; i >= 0; i--)
+        if (rx.fec[i]->hash == hash)
+            return i;
+    return -1;
+}
+
+static void fec_parity(const uint8_t *buf, size_t len)
+{
+    const uint8_t *payloads[SCREAM_FEC_MAX_GROUP];
+    int where[SCREAM_FEC_MAX_GROUP];
+    struct scream_fec_info fi;
+    struct scream_ext_header xh;
+    uint8_t out[MAX_PACKET];
+    unsigned int i, j, hdr = 0;
+    int m, nb = -1;
+    struct pkt *p;
+
+    if (scream_fec_parse(buf, len, &fi))
+        return;
+    rx.total.fec_parity++;
+    /* Without the extended header identical packets (silence, a repeated
+     * buffer) hash alike: such a group's members cannot be told apart */
+    for (i = 1; i < fi.group; i++) {
+        for (j = 0; j < i; j++) {
+            if (scream_fec_member_hash(&fi, i) == scream_fec_member_hash(&fi, j)) {
+                rx.total.fec_ambiguous++;
+                return;
+            }
+        }
+    }
+    for (i = 0; i < fi.group; i++) {
+        where[i] = fec_find(scream_fec_member_hash(&fi, i));
+        payloads[i] = NULL;
+        if (where[i] < 0)
+            continue;
+        p = rx.fec[where[i]];
+        hdr = (p->data[4] & SCREAM_FLAG_EXT) ? SCREAM_EXT_HEADER_SIZE : SCREAM_BASE_HEADER_SIZE;
+        if (p->len != hdr + fi.payload_len)
+            where[i] = -1;
+        else
+            payloads[i] = p->data + hdr;
+    }
+    if (hdr + fi.payload_len > MAX_PACKET)
+        return;
+    m = scream_fec_recover(&fi, payloads, out);
+    if (m < 0)
+        return;
+
+    /* The nearest member still held tells where the repair goes */
+    for (i = 0; i < fi.group; i++)
+        if (where[i] >= 0 && (nb < 0 || abs((int)i - m) < abs(nb - m)))
+            nb = i;
+    if (nb < 0) {
+        rx.total.fec_late++;
+        return;
+    }
+    p = pkt_get();
+    if (!p)
+        return;
+    /* The header is the neighbour's; the extended fields follow from it */
+    hdr = rx.fec[where[nb]]->len - fi.payload_len;
+    memcpy(p->data, rx.fec[where[nb]]->data, hdr);
+    memcpy(p->data + hdr, out, fi.payload_len);
+    p->len = hdr + fi.payload_len;
+    if (!scream_ext_get(p->data, p->len, &xh)) {
+        unsigned int fb = frame_bytes(&rx.fmt);
+        int d = m - nb;
+
+        scream_ext_put(p->data, xh.seq + d, xh.frame + (int64_t)d * (fb ? fi.payload_len / fb : 0),
+                       xh.time_ns);
+    }
+    p->hash = scream_fec_member_hash(&fi, m);
+    fec_insert(nb < m ? where[nb] + 1 : where[nb], p);
+    rx.total.fec_repaired++;
+    rx.win.fec_repaired++;
+}
+
+static void fec_drain(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < rx.fec_len; i++) {
+        deliver(rx.fec[i]->data, rx.fec[i]->len);
+        free(rx.fec[i]);
+    }
+    rx.fec_len = 0;
+}
+
+/* ------------------------------
+ *      Back channel
+ * ------------------------------ */
+static void send_record(const uint8_t *rec)
+{
+    if (rx.tcp) {
+        if (rx.conn >= 0 && send(rx.conn, rec, 8, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno != EAGAIN)
+            perror("send");
+    } else if (rx.have_peer) {
+        sendto(rx.fd, rec, 8, MSG_DONTWAIT, (struct sockaddr *)&rx.peer, sizeof(rx.peer));
+    }
+}
+
+/* Fill of a buffer played out at the nominal rate from feedback_ms after
+ * the first packet: what a real receiver would report */
+static void send_feedback(uint64_t t)
+{
+    uint8_t rec[8];
+
+    if (rx.ask_ext) {
+        memcpy(rec, SCREAM_XH_MAGIC, 4);
+        put_le(rec + 4, SCREAM_CAP_EXT_HEADER, 4);
+        send_record(rec);
+    }
+    if (rx.feedback_ms > 0 && rx.t0_ns && rx.have_fmt) {
+        unsigned int rate = rx.fmt.bits == 1 ? rx.fmt.rate / 32 : rx.fmt.rate;
+        int64_t recv_us = (int64_t)(rx.stream_frames * 1000000ull / rate);
+        int64_t played_us = (int64_t)(t - rx.t0_ns) / 1000 - rx.feedback_ms * 1000;
+        int64_t fill = recv_us - (played_us > 0 ? played_us : 0);
+
+        memcpy(rec, "SCFB", 4);
+        put_le(rec + 4, fill > 0 ? (uint64_t)fill : 0, 4);
+        send_record(rec);
+    }
+}
+
+/* ------------------------------
+ *      Reports
+ * ------------------------------ */
+static void report(const struct stats *s, double secs, bool final)
+{
+    double drift = 0;
+    double den = rx.fit_n * rx.fit_tt - rx.fit_t * rx.fit_t;
+
+    /* Slope of the least-squares fit, so a late start or one stall does not
+     * read as drift. Positive: the sender runs faster than the nominal rate */
+    if (rx.have_fmt && rx.fit_n > 2 && den > 0) {
+        unsigned int rate = rx.fmt.bits == 1 ? rx.fmt.rate / 32 : rx.fmt.rate;
+        double slope = (rx.fit_n * rx.fit_tf - rx.fit_t * rx.fit_f) / den;
+
+        drift = (slope / rate - 1.0) * 1e6;
+    }
+    printf("%s%.1fs: %.3f Mbit/s %.0f pkt/s %.0f frames/s gaps %" PRIu64 " lost %" PRIu64
+           " reordered %" PRIu64 " drift %+.1f ppm",
+           final ? "total " : "", secs, s->bytes * 8 / secs / 1e6, s->packets / secs,
+           s->frames / secs, s->gaps, s->lost, s->reordered, drift);
+    if (rx.use_fec)
+        printf(" fec_repaired %" PRIu64, s->fec_repaired);
+    if (s->lat_n)
+        printf(" latency_us avg %.1f min %.1f max %.1f", s->lat_sum / (double)s->lat_n / 1e3,
+               s->lat_min / 1e3, s->lat_max / 1e3);
+    printf("\n");
+    if (final || !rx.quiet) {
+        hist_print("inter-arrival", s->iat_hist);
+        hist_print("timeline deviation", s->dev_hist);
+    }
+    if (final) {
+        printf("  tracks %" PRIu64 " bad %" PRIu64 " silent_frames %" PRIu64, s->tracks, s->bad,
+               s->silent_frames);
+        if (s->lz4_packets)
+            printf(" lz4 %" PRIu64 " at %.1f%%", s->lz4_packets, 100.0 * s->lz4_wire / s->lz4_raw);
+        if (rx.use_fec)
+            printf(" parity %" PRIu64 " repaired %" PRIu64 " too_late %" PRIu64 " ambiguous %" PRIu64,
+                   s->fec_parity, s->fec_repaired, s->fec_late, s->fec_ambiguous);
+        printf("\n");
+    }
+}
+
+/* ------------------------------
+ *      Sockets
+ * ------------------------------ */
+static int open_udp(int port)
+{
+    struct sockaddr_in a = { .sin_family = AF_INET, .sin_port = htons(port) };
+    int fd = socket(AF_INET, SOCK_DGRAM, 0), one = 1, sz = 16 << 20;
+
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    /* Force past rmem_max when allowed; 1.5 MHz x 8 ch is ~50 MB/s */
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &sz, sizeof(sz)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+    a.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *)&a, sizeof(a)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (rx.group) {
+        struct ip_mreq m = { .imr_interface.s_addr = htonl(INADDR_ANY) };
+
+        if (inet_pton(AF_INET, rx.group, &m.imr_multiaddr) != 1 ||
+            setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &m, sizeof(m)) < 0) {
+            perror("multicast join");
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+static int open_tcp(int port)
+{
+    struct sockaddr_in a = { .sin_family = AF_INET, .sin_port = htons(port) };
+    int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    a.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *)&a, sizeof(a)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Kernel stamps are CLOCK_REALTIME: offset onto the monotonic clock once per batch */
+static int64_t realtime_offset(void)
+{
+    struct timespec r, m;
+
+    clock_gettime(CLOCK_REALTIME, &r);
+    clock_gettime(CLOCK_MONOTONIC, &m);
+    return (int64_t)(r.tv_sec - m.tv_sec) * 1000000000ll + (r.tv_nsec - m.tv_nsec);
+}
+
+static uint64_t cmsg_time(struct msghdr *mh, int64_t offset, uint64_t fallback)
+{
+    struct cmsghdr *c;
+    struct timespec ts;
+
+    for (c = CMSG_FIRSTHDR(mh); c; c = CMSG_NXTHDR(mh, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec - offset;
+        }
+    }
+    return fallback;
+}
+
+static void handle_data(const uint8_t *buf, size_t len, uint64_t t)
+{
+    account_arrival(buf, len, t);
+    if (rx.use_fec)
+        fec_data(buf, len);
+    else
+        deliver(buf, len);
+}
+
+static void recv_udp(int fd, bool parity)
+{
+    static uint8_t bufs[BATCH][MAX_PACKET];
+    static uint8_t ctl[BATCH][64];
+    struct mmsghdr mm[BATCH];
+    struct iovec iov[BATCH];
+    struct sockaddr_in from[BATCH];
+    uint64_t t = now_ns();
+    int64_t offset = realtime_offset();
+    int n, i;
+
+    for (i = 0; i < BATCH; i++) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = MAX_PACKET;
+        memset(&mm[i].msg_hdr, 0, sizeof(mm[i].msg_hdr));
+        mm[i].msg_hdr.msg_iov = &iov[i];
+        mm[i].msg_hdr.msg_iovlen = 1;
+        mm[i].msg_hdr.msg_name = &from[i];
+        mm[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        mm[i].msg_hdr.msg_control = ctl[i];
+        mm[i].msg_hdr.msg_controllen = sizeof(ctl[i]);
+    }
+    n = recvmmsg(fd, mm, BATCH, MSG_DONTWAIT, NULL);
+    for (i = 0; i < n; i++) {
+        if (parity) {
+            if (rx.use_fec)
+                fec_parity(bufs[i], mm[i].msg_len);
+            continue;
+        }
+        rx.peer = from[i];
+        rx.have_peer = true;
+        handle_data(bufs[i], mm[i].msg_len, cmsg_time(&mm[i].msg_hdr, offset, t));
+    }
+}
+
+/* TCP carries no packet length: base header, the extension if flagged,
+ * then a fixed payload (-P, 1152 by default) */
+static void recv_tcp(void)
+{
+    static uint8_t pkt[MAX_PACKET];
+    static size_t have;
+    size_t want;
+    ssize_t r;
+
+    for (;;) {
+        want = SCREAM_BASE_HEADER_SIZE;
+        if (have >= SCREAM_BASE_HEADER_SIZE)
+            want = ((pkt[4] & SCREAM_FLAG_EXT) ? SCREAM_EXT_HEADER_SIZE : SCREAM_BASE_HEADER_SIZE) +
+                   rx.tcp_payload;
+        r = recv(rx.conn, pkt + have, want - have, MSG_DONTWAIT);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+            if (!rx.quiet)
+                printf("sender disconnected\n");
+            close(rx.conn);
+            rx.conn = -1;
+            have = 0;
+            stream_reset();
+            return;
+        }
+        if (r < 0)
+            return;
+        have += r;
+        if (have == want && want > SCREAM_BASE_HEADER_SIZE) {
+            /* The end marker is sent as a whole packet of silence over TCP */
+            handle_data(pkt, (pkt[4] & SCREAM_FLAG_END) ? SCREAM_BASE_HEADER_SIZE : have, now_ns());
+            have = 0;
+        }
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -t          listen on TCP instead of UDP\n"
+            "  -p port     port to listen on (default %d)\n"
+            "  -g group    join a multicast group (UDP)\n"
+            "  -w file     write PCM streams to a WAV file\n"
+            "  -d file     write DSD streams to a DSF file\n"
+            "  -P bytes    TCP payload size (default %d)\n"
+            "  -x          ask the sender for the extended header\n"
+            "  -F          repair losses from FEC parity on port + 1 (UDP; best with -x)\n"
+            "  -E port     FEC parity port, as the card's fec_ports (implies -F)\n"
+            "  -f ms       send buffer-fill feedback for a playout buffer of ms\n"
+            "  -G ms       arrival pause counted as a gap (default 20)\n"
+            "  -i secs     report interval (default 1)\n"
+            "  -q          only print the final summary\n",
+            prog, DEFAULT_PORT, LEGACY_PAYLOAD);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t start, next_report, next_fb;
+    int c;
+
+    while ((c = getopt(argc, argv, "tp:g:w:d:P:xFE:f:G:i:qh")) != -1) {
+        switch (c) {
+        case 't': rx.tcp = true; break;
+        case 'p': rx.port = atoi(optarg); break;
+        case 'g': rx.group = optarg; break;
+        case 'w': rx.wav_path = optarg; break;
+        case 'd': rx.dsf_path = optarg; break;
+        case 'P': rx.tcp_payload = strtoul(optarg, NULL, 0); break;
+        case 'x': rx.ask_ext = true; break;
+        case 'F': rx.use_fec = true; break;
+        case 'E': rx.use_fec = true; rx.fec_port = atoi(optarg); break;
+        case 'f': rx.feedback_ms = atoi(optarg); break;
+        case 'G': rx.gap_ms = atoi(optarg); break;
+        case 'i': rx.interval = atoi(optarg); break;
+        case 'q': rx.quiet = true; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 2;
+        }
+    }
+    if (rx.use_fec && !rx.fec_port)
+        rx.fec_port = rx.port + 1;
+    if (rx.interval < 1 || rx.port <= 0 || rx.port > 65534 || rx.fec_port < 0 || rx.fec_port > 65535 ||
+        !rx.tcp_payload || rx.tcp_payload > MAX_PACKET - SCREAM_EXT_HEADER_SIZE) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (rx.tcp && rx.use_fec) {
+        fprintf(stderr, "FEC is only sent over UDP\n");
+        return 2;
+    }
+    if (rx.use_fec && !rx.ask_ext && !rx.quiet)
+        fprintf(stderr, "note: without the extended header (-x, or ext_header=1 on the sender) "
+                "repeated packets such as silence cannot be repaired\n");
+
+    rx.fd = rx.tcp ? open_tcp(rx.port) : open_udp(rx.port);
+    if (rx.fd < 0) {
+        perror("listen");
+        return 1;
+    }
+    if (rx.use_fec && (rx.fec_fd = open_udp(rx.fec_port)) < 0) {
+        perror("FEC port");
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    if (!rx.quiet)
+        printf("listening on %s port %d\n", rx.tcp ? "TCP" : "UDP", rx.port);
+
+    start = rx.win_start_ns = now_ns();
+    next_report = start + rx.interval * 1000000000ull;
+    next_fb = start;
+    while (!stop) {
+        struct pollfd pf[2];
+        int nfd = 0, timeout;
+        uint64_t t = now_ns();
+
+        if (t >= next_fb) {
+            send_feedback(t);
+            next_fb = t + (rx.feedback_ms > 0 ? 10000000ull : 1000000000ull);
+        }
+        if (t >= next_report) {
+            report(&rx.win, (t - rx.win_start_ns) / 1e9, false);
+            memset(&rx.win, 0, sizeof(rx.win));
+            rx.win_start_ns = t;
+            next_report += rx.interval * 1000000000ull;
+        }
+        timeout = (int)(((next_fb < next_report ? next_fb : next_report) - t) / 1000000) + 1;
+
+        pf[nfd].fd = rx.tcp && rx.conn >= 0 ? rx.conn : rx.fd;
+        pf[nfd++].events = POLLIN;
+        if (rx.fec_fd >= 0) {
+            pf[nfd].fd = rx.fec_fd;
+            pf[nfd++].events = POLLIN;
+        }
+        if (poll(pf, nfd, timeout) <= 0)
+            continue;
+
+        if (pf[0].revents) {
+            if (!rx.tcp) {
+                recv_udp(rx.fd, false);
+            } else if (rx.conn < 0) {
+                socklen_t l = sizeof(rx.peer);
+
+                rx.conn = accept(rx.fd, (struct sockaddr *)&rx.peer, &l);
+                if (rx.conn >= 0 && !rx.quiet)
+                    printf("sender %s connected\n", inet_ntoa(rx.peer.sin_addr));
+            } else {
+                recv_tcp();
+            }
+        }
+        if (nfd > 1 && pf[1].revents)
+            recv_udp(rx.fec_fd, true);
+    }
+
+    fec_drain();
+    out_close();
+    report(&rx.total, (now_ns() - start) / 1e9, true);
+    while (rx.pool_len)
+        free(rx.pool[--rx.pool_len]);
+    return 0;
+}